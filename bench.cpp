@@ -0,0 +1,403 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+
+#include "heap.h"
+#include "poke327.h"
+#include "character.h"
+#include "io.h"
+
+/* Microbenchmarks for the parts of the game that matter most to how    *
+ * fast it runs, built from the game's own objects by make bench.  Each *
+ * benchmark does a fixed batch of work per repetition, timing only the *
+ * part being measured, and reports time per operation.  The first few  *
+ * repetitions warm the caches and the heap's free list and are thrown  *
+ * away.  Results go to stdout as JSON, tagged with the version named   *
+ * by -v, for keeping and comparing against later versions; a table of  *
+ * the same goes to stderr.  Everything is seeded, so every version     *
+ * does the same work.                                                  */
+
+#define BENCH_WARMUP 3
+#define BENCH_REPS 25
+#define BENCH_HEAP_SIZE 4096
+#define BENCH_SIGHTS 4096
+#define BENCH_MAPS 8
+#define BENCH_FRAMES 64
+
+/* Everyone but swimmers sees past all of this */
+#define BENCH_SIGHT_CLASS (~(ter_mask(ter_boulder) | ter_mask(ter_tree) | \
+                             ter_mask(ter_mountain) | ter_mask(ter_forest)))
+
+typedef struct bench {
+  const char *name;
+  /* The world to run in, or 0 for none */
+  uint32_t seed;
+  /* Operations done per repetition */
+  uint32_t ops;
+  /* Does one repetition, returning the nanoseconds the timed part took */
+  uint64_t (*run)(const struct bench *b);
+} bench_t;
+
+typedef struct bench_result {
+  double min, median, mean, stddev, max;
+} bench_result_t;
+
+/* The world the benchmarks are running in, 0 if it's been disturbed */
+static uint32_t bench_world_seed;
+static int32_t bench_heap_key[BENCH_HEAP_SIZE];
+static heap_node_t *bench_heap_node[BENCH_HEAP_SIZE];
+
+static uint64_t bench_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* A freshly generated world for seed, the way the game starts one */
+static void bench_world(uint32_t seed)
+{
+  if (bench_world_seed == seed) {
+    return;
+  }
+
+  delete_world();
+  srand(seed);
+  world.seed = seed;
+  world.lod = 1;
+  init_world();
+  bench_world_seed = seed;
+}
+
+static int32_t bench_heap_cmp(const void *key, const void *with)
+{
+  return *(const int32_t *) key - *(const int32_t *) with;
+}
+
+/* The same BENCH_HEAP_SIZE random keys every time */
+static void bench_heap_keys(void)
+{
+  uint32_t i;
+
+  srand(1);
+  for (i = 0; i < BENCH_HEAP_SIZE; i++) {
+    bench_heap_key[i] = rand() % 1000000;
+  }
+}
+
+static void bench_heap_fill(heap_t *h)
+{
+  uint32_t i;
+
+  heap_init(h, bench_heap_cmp, NULL);
+  for (i = 0; i < BENCH_HEAP_SIZE; i++) {
+    bench_heap_node[i] = heap_insert(h, bench_heap_key + i);
+  }
+}
+
+static uint64_t bench_heap_insert(const bench_t *b)
+{
+  uint64_t t;
+  heap_t h;
+
+  bench_heap_keys();
+  t = bench_now();
+  bench_heap_fill(&h);
+  t = bench_now() - t;
+  heap_delete(&h);
+
+  return t;
+}
+
+static uint64_t bench_heap_remove_min(const bench_t *b)
+{
+  uint64_t t;
+  heap_t h;
+
+  bench_heap_keys();
+  bench_heap_fill(&h);
+  t = bench_now();
+  while (heap_remove_min(&h))
+    ;
+  t = bench_now() - t;
+  heap_delete(&h);
+
+  return t;
+}
+
+/* After the first remove_min, so there's a tree shape to cut from */
+static uint64_t bench_heap_decrease_key(const bench_t *b)
+{
+  uint64_t t;
+  uint32_t i;
+  heap_t h;
+
+  bench_heap_keys();
+  bench_heap_fill(&h);
+  for (i = 0; i < BENCH_HEAP_SIZE; i++) {
+    if (heap_peek_min(&h) == bench_heap_key + i) {
+      bench_heap_node[i] = NULL;
+    }
+  }
+  heap_remove_min(&h);
+  t = bench_now();
+  for (i = 0; i < BENCH_HEAP_SIZE; i++) {
+    if (bench_heap_node[i]) {
+      bench_heap_key[i] -= rand() % 1000;
+      heap_decrease_key_no_replace(&h, bench_heap_node[i]);
+    }
+  }
+  t = bench_now() - t;
+  heap_delete(&h);
+
+  return t;
+}
+
+static uint64_t bench_pathfind(const bench_t *b)
+{
+  uint64_t t;
+
+  bench_world(b->seed);
+  t = bench_now();
+  pathfind(world.cur_map);
+
+  return bench_now() - t;
+}
+
+/* The center map's first road, laid again over the terrain it left */
+static uint64_t bench_dijkstra(const bench_t *b)
+{
+  pair_t from, to;
+  uint64_t t;
+
+  bench_world(b->seed);
+  from[dim_x] = 1;
+  to[dim_x] = MAP_X - 2;
+  from[dim_y] = world.cur_map->w;
+  to[dim_y] = world.cur_map->e;
+  t = bench_now();
+  bench_dijkstra_path(from, to);
+
+  return bench_now() - t;
+}
+
+/* Walking east from the center, generating a map at each step */
+static uint64_t bench_new_map(const bench_t *b)
+{
+  uint64_t t;
+  uint32_t i;
+
+  /* A new world each time, and one nobody else can use after */
+  bench_world_seed = 0;
+  bench_world(b->seed);
+  bench_world_seed = 0;
+  t = bench_now();
+  for (i = 0; i < b->ops; i++) {
+    world.cur_idx[dim_x]++;
+    new_map(0);
+  }
+
+  return bench_now() - t;
+}
+
+static uint64_t bench_can_see(const bench_t *b)
+{
+  static int16_t at[BENCH_SIGHTS][2][2];
+  uint32_t i, seen;
+  uint64_t t;
+
+  bench_world(b->seed);
+  srand(b->seed);
+  for (i = 0; i < BENCH_SIGHTS; i++) {
+    at[i][0][dim_x] = rand_range(1, MAP_X - 2);
+    at[i][0][dim_y] = rand_range(1, MAP_Y - 2);
+    at[i][1][dim_x] = rand_range(1, MAP_X - 2);
+    at[i][1][dim_y] = rand_range(1, MAP_Y - 2);
+  }
+  t = bench_now();
+  for (seen = i = 0; i < BENCH_SIGHTS; i++) {
+    seen += can_see(world.cur_map, at[i][0], at[i][1], BENCH_SIGHT_CLASS);
+  }
+  t = bench_now() - t;
+
+  /* So the calls can't be thrown away */
+  return seen > BENCH_SIGHTS ? 0 : t;
+}
+
+/* Drawing the whole map, as after changing maps */
+static uint64_t bench_display_full(const bench_t *b)
+{
+  uint64_t t, total;
+  uint32_t i, y;
+
+  bench_world(b->seed);
+  for (total = i = 0; i < b->ops; i++) {
+    for (y = 0; y < MAP_Y; y++) {
+      world.cur_map->dirty[y] = row_span(0, MAP_X - 1);
+    }
+    t = bench_now();
+    io_display();
+    total += bench_now() - t;
+  }
+
+  return total;
+}
+
+/* Drawing when nothing has changed, the floor under every turn */
+static uint64_t bench_display_idle(const bench_t *b)
+{
+  uint64_t t;
+  uint32_t i;
+
+  bench_world(b->seed);
+  io_display();
+  t = bench_now();
+  for (i = 0; i < b->ops; i++) {
+    io_display();
+  }
+
+  return bench_now() - t;
+}
+
+static const bench_t benches[] = {
+  { "heap_insert",       0,  BENCH_HEAP_SIZE,     bench_heap_insert },
+  { "heap_remove_min",   0,  BENCH_HEAP_SIZE,     bench_heap_remove_min },
+  { "heap_decrease_key", 0,  BENCH_HEAP_SIZE - 1, bench_heap_decrease_key },
+  { "pathfind",          1,  1,                   bench_pathfind },
+  { "pathfind",          7,  1,                   bench_pathfind },
+  { "pathfind",          42, 1,                   bench_pathfind },
+  { "dijkstra_path",     1,  1,                   bench_dijkstra },
+  { "dijkstra_path",     42, 1,                   bench_dijkstra },
+  { "can_see",           1,  BENCH_SIGHTS,        bench_can_see },
+  { "io_display_full",   1,  BENCH_FRAMES,        bench_display_full },
+  { "io_display_idle",   1,  BENCH_FRAMES,        bench_display_idle },
+  { "new_map",           1,  BENCH_MAPS,          bench_new_map },
+  { "new_map",           42, BENCH_MAPS,          bench_new_map },
+};
+
+#define num_benches (sizeof (benches) / sizeof (benches[0]))
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+  return (*(const double *) a > *(const double *) b) -
+         (*(const double *) a < *(const double *) b);
+}
+
+/* Nanoseconds per operation, over reps repetitions after warmup more */
+static void bench_run(const bench_t *b, uint32_t warmup, uint32_t reps,
+                      bench_result_t *r)
+{
+  double *ns, sum, sq;
+  uint32_t i;
+
+  for (i = 0; i < warmup; i++) {
+    b->run(b);
+  }
+
+  ns = (double *) malloc(reps * sizeof (*ns));
+  for (sum = 0, i = 0; i < reps; i++) {
+    ns[i] = b->run(b) / (double) b->ops;
+    sum += ns[i];
+  }
+  qsort(ns, reps, sizeof (*ns), bench_cmp_double);
+
+  r->min = ns[0];
+  r->max = ns[reps - 1];
+  r->mean = sum / reps;
+  r->median = (reps % 2 ? ns[reps / 2] :
+               (ns[reps / 2 - 1] + ns[reps / 2]) / 2);
+  for (sq = 0, i = 0; i < reps; i++) {
+    sq += (ns[i] - r->mean) * (ns[i] - r->mean);
+  }
+  r->stddev = reps > 1 ? sqrt(sq / (reps - 1)) : 0;
+
+  free(ns);
+}
+
+static void usage(char *s)
+{
+  fprintf(stderr, "Usage: %s [-w|--warmup <reps>] [-r|--reps <reps>]\n"
+          "       [-b|--bench <name>] [-v|--version <name>]\n", s);
+
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  bench_result_t r;
+  const char *only, *version;
+  uint32_t warmup, reps, i;
+  int first;
+
+  warmup = BENCH_WARMUP;
+  reps = BENCH_REPS;
+  only = NULL;
+  version = "unknown";
+
+  for (i = 1; i < (uint32_t) argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1] == '-') {
+      argv[i]++;
+    }
+    if (i + 1 >= (uint32_t) argc) {
+      usage(argv[0]);
+    }
+    if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "-warmup")) {
+      if (!sscanf(argv[++i], "%u", &warmup)) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "-reps")) {
+      if (!sscanf(argv[++i], "%u", &reps) || !reps) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "-bench")) {
+      only = argv[++i];
+    } else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "-version")) {
+      version = argv[++i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  /* Drawn into memory, so the terminal doesn't come into it */
+  io_init_headless(NULL, 0);
+  io_init_render(io_render_memory);
+
+  printf("{\n"
+         "  \"version\": \"%s\",\n"
+         "  \"warmup\": %u,\n"
+         "  \"reps\": %u,\n"
+         "  \"unit\": \"ns/op\",\n"
+         "  \"benchmarks\": [", version, warmup, reps);
+  fprintf(stderr, "%-18s %4s %12s %12s %12s %12s %12s\n", "ns/op", "seed",
+          "min", "median", "mean", "stddev", "max");
+
+  for (first = 1, i = 0; i < num_benches; i++) {
+    if (only && strcmp(only, benches[i].name)) {
+      continue;
+    }
+
+    bench_run(benches + i, warmup, reps, &r);
+
+    printf("%s\n    { \"name\": \"%s\", \"seed\": %u, \"ops\": %u, "
+           "\"min\": %.1f, \"median\": %.1f, \"mean\": %.1f, "
+           "\"stddev\": %.1f, \"max\": %.1f }", first ? "" : ",",
+           benches[i].name, benches[i].seed, benches[i].ops,
+           r.min, r.median, r.mean, r.stddev, r.max);
+    fprintf(stderr, "%-18s %4u %12.1f %12.1f %12.1f %12.1f %12.1f\n",
+            benches[i].name, benches[i].seed,
+            r.min, r.median, r.mean, r.stddev, r.max);
+    first = 0;
+  }
+
+  printf("\n  ]\n}\n");
+
+  io_reset_terminal();
+  delete_world();
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef BITBOARD_H
+# define BITBOARD_H
+
+# include <cstdint>
+
+/* One bit per column.  A map row is 80 cells wide, so a whole row fits in *
+ * a single 128-bit word and shifting it by one column is a single shift. */
+typedef unsigned __int128 row_t;
+
+# define ROW_BITS 128
+
+# define row_bit(x) (((row_t) 1) << (x))
+/* Columns [lo, hi], inclusive */
+# define row_span(lo, hi) ((row_bit((hi) + 1) - 1) & ~(row_bit(lo) - 1))
+# define row_test(r, x) (((r) >> (x)) & 1)
+
+static inline int row_popcount(row_t r)
+{
+  return (__builtin_popcountll((uint64_t) r) +
+          __builtin_popcountll((uint64_t) (r >> 64)));
+}
+
+/* Index of the lowest set bit.  r must be nonzero. */
+static inline int row_ctz(row_t r)
+{
+  return ((uint64_t) r ?
+          __builtin_ctzll((uint64_t) r) :
+          64 + __builtin_ctzll((uint64_t) (r >> 64)));
+}
+
+/* Index of the highest set bit.  r must be nonzero. */
+static inline int row_top(row_t r)
+{
+  return ((uint64_t) (r >> 64) ?
+          127 - __builtin_clzll((uint64_t) (r >> 64)) :
+          63 - __builtin_clzll((uint64_t) r));
+}
+
+/* Index of the nth (from zero) set bit.  r must have more than n bits set. */
+static inline int row_select(row_t r, int n)
+{
+  while (n--) {
+    r &= r - 1;
+  }
+
+  return row_ctz(r);
+}
+
+#endif
@@ -1,8 +1,10 @@
 #include <climits>
+#include <cstring>
 
 #include "character.h"
 #include "poke327.h"
 #include "io.h"
+#include "prof.h"
 
 /* Just to make the following table fit in 80 columns */
 #define PM DIJKSTRA_PATH_MAX
@@ -28,22 +30,27 @@ const char *char_type_name[num_character_types] = {
   "Trainer"
 };
 
-#define is_adjacent(pos, ter)                                \
-  ((world.cur_map->map[pos[dim_y] - 1][pos[dim_x] - 1] == ter) || \
-   (world.cur_map->map[pos[dim_y] - 1][pos[dim_x]    ] == ter) || \
-   (world.cur_map->map[pos[dim_y] - 1][pos[dim_x] + 1] == ter) || \
-   (world.cur_map->map[pos[dim_y]    ][pos[dim_x] - 1] == ter) || \
-   (world.cur_map->map[pos[dim_y]    ][pos[dim_x] + 1] == ter) || \
-   (world.cur_map->map[pos[dim_y] + 1][pos[dim_x] - 1] == ter) || \
-   (world.cur_map->map[pos[dim_y] + 1][pos[dim_x]    ] == ter) || \
-   (world.cur_map->map[pos[dim_y] + 1][pos[dim_x] + 1] == ter))
-
-bool is_pc(character *c)
-{
-  return c == &world.pc;
-}
+/* A bridge is a path over or adjacent to water */
+#define is_bridge(m, x, y)                                   \
+  (ter_is(m, x, y, ter_path) && nbr_mask(m, nbr_water, x, y))
+
+/* Swimmers can see across water and paths */
+#define SWIM_CLASS (ter_mask(ter_water) | ter_mask(ter_path))
+/* Everyone else can see past anything that isn't in the way */
+#define SIGHT_CLASS (~(ter_mask(ter_boulder) | ter_mask(ter_tree) | \
+                       ter_mask(ter_mountain) | ter_mask(ter_forest)))
+/* Pacers stay on open ground */
+#define PACE_CLASS (ter_mask(ter_path)  | ter_mask(ter_grass) | \
+                    ter_mask(ter_clearing))
+
+const uint32_t nbr_class[num_nbr_classes] = {
+  ter_mask(ter_water),
+  PACE_CLASS,
+  0 /* From move_cost; see nbr_in() */
+};
 
-uint32_t can_see(map *m, character *voyeur, character *exhibitionist)
+uint32_t can_see(map *m, const pair_t voyeur, const pair_t exhibitionist,
+                 uint32_t clear)
 {
   /* Application of Bresenham's Line Drawing Algorithm.  If we can draw a   *
    * line from v to e without intersecting any foreign terrain, then v can  *
@@ -53,18 +60,19 @@ uint32_t can_see(map *m, character *voyeur, character *exhibitionist)
    * ignore for now.  Algorithms that are symmetrical are far more          *
    * expensive.                                                             */
 
-  /* Adapted from rlg327.  For the purposes of poke327, can swimmers see    *
-   * the PC adjacent to water or on a bridge?  v is always a swimmer, and e *
-   * is always the player character.                                        */
+  /* Adapted from rlg327.  For the purposes of poke327, can an NPC see the  *
+   * PC?  v is always an NPC deciding whether to doze off, and e is always  *
+   * the player character.  clear is the class of terrain that doesn't      *
+   * block the view.  Swimmers use shadowcast() instead.                    */
 
   pair_t first, second;
   pair_t del, f;
   int16_t a, b, c, i;
 
-  first[dim_x] = voyeur->pos[dim_x];
-  first[dim_y] = voyeur->pos[dim_y];
-  second[dim_x] = exhibitionist->pos[dim_x];
-  second[dim_y] = exhibitionist->pos[dim_y];
+  first[dim_x] = voyeur[dim_x];
+  first[dim_y] = voyeur[dim_y];
+  second[dim_x] = exhibitionist[dim_x];
+  second[dim_y] = exhibitionist[dim_y];
 
   if (second[dim_x] > first[dim_x]) {
     del[dim_x] = second[dim_x] - first[dim_x];
@@ -87,7 +95,7 @@ uint32_t can_see(map *m, character *voyeur, character *exhibitionist)
     c = a - del[dim_x];
     b = c - del[dim_x];
     for (i = 0; i <= del[dim_x]; i++) {
-      if (((mappair(first) != ter_water) && (mappair(first) != ter_path)) &&
+      if (!ter_in(m, first[dim_x], first[dim_y], clear) &&
           i && (i != del[dim_x])) {
         return 0;
       }
@@ -105,7 +113,7 @@ uint32_t can_see(map *m, character *voyeur, character *exhibitionist)
     c = a - del[dim_y];
     b = c - del[dim_y];
     for (i = 0; i <= del[dim_y]; i++) {
-      if (((mappair(first) != ter_water) && (mappair(first) != ter_path)) &&
+      if (!ter_in(m, first[dim_x], first[dim_y], clear) &&
           i && (i != del[dim_y])) {
         return 0;
       }
@@ -123,250 +131,388 @@ uint32_t can_see(map *m, character *voyeur, character *exhibitionist)
   return 1;
 }
 
-static void move_hiker_func(character *c, pair_t dest)
+/* Quadrants for shadowcast(): the direction of increasing depth and of *
+ * increasing column in each of north, east, south and west.            */
+static const int8_t shadow_quad[4][2][2] = {
+  { {  0, -1 }, { 1, 0 } },
+  { {  1,  0 }, { 0, 1 } },
+  { {  0,  1 }, { 1, 0 } },
+  { { -1,  0 }, { 0, 1 } },
+};
+
+static inline int32_t floor_div(int32_t a, int32_t b)
+{
+  return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+static void shadow_scan(map *m, const pair_t o, int q, int16_t depth,
+                        int32_t sn, int32_t sd, int32_t en, int32_t ed,
+                        uint32_t clear, row_t seen[MAP_Y])
+{
+  int16_t col, x, y;
+  int prev, wall;
+
+  /* Columns whose centers fall within the slopes, ties going outward */
+  col = floor_div(2 * depth * sn + sd, 2 * sd);
+  for (prev = -1;
+       col <= -floor_div(ed - 2 * depth * en, 2 * ed);
+       col++, prev = wall) {
+    x = o[dim_x] + depth * shadow_quad[q][0][dim_x] +
+      col * shadow_quad[q][1][dim_x];
+    y = o[dim_y] + depth * shadow_quad[q][0][dim_y] +
+      col * shadow_quad[q][1][dim_y];
+    wall = (x < 0 || x >= MAP_X || y < 0 || y >= MAP_Y ||
+            !ter_in(m, x, y, clear));
+
+    if (x >= 0 && x < MAP_X && y >= 0 && y < MAP_Y &&
+        (wall || (col * sd >= depth * sn && col * ed <= depth * en))) {
+      seen[y] |= row_bit(x);
+    }
+    if (prev == 1 && !wall) {
+      sn = 2 * col - 1;
+      sd = 2 * depth;
+    }
+    if (prev == 0 && wall) {
+      shadow_scan(m, o, q, depth + 1, sn, sd, 2 * col - 1, 2 * depth,
+                  clear, seen);
+    }
+  }
+
+  if (prev == 0) {
+    shadow_scan(m, o, q, depth + 1, sn, sd, en, ed, clear, seen);
+  }
+}
+
+/* Marks in seen every cell in view of o, where only terrain in clear   *
+ * lets the view through.  This is Albert Ford's symmetric              *
+ * shadowcasting, so unlike can_see(), o sees a clear cell exactly when *
+ * that cell sees o.  Blocking cells are seen if any part of them is.  */
+void shadowcast(map *m, const pair_t o, uint32_t clear, row_t seen[MAP_Y])
+{
+  int q;
+
+  memset(seen, 0, MAP_Y * sizeof (*seen));
+  seen[o[dim_y]] |= row_bit(o[dim_x]);
+
+  for (q = 0; q < 4; q++) {
+    shadow_scan(m, o, q, 1, -1, 1, 1, 1, clear, seen);
+  }
+}
+
+/* Swimmers go after the PC when it's standing next to their water and *
+ * they can see it.  Rather than every swimmer working that out for    *
+ * itself, every PC move marks the cells a swimmer would have to be in *
+ * to notice it.                                                       */
+void find_swim_view(map *m)
 {
+  row_t seen[MAP_Y], r;
+  uint16_t water[8];
+  pair_t p;
+  int16_t x, y;
+  int i, j, n;
+
+  memset(world.swim_view, 0, sizeof (world.swim_view));
+
+  for (n = i = 0; i < 8; i++) {
+    x = world.pc.pos[dim_x] + all_dirs[i][dim_x];
+    y = world.pc.pos[dim_y] + all_dirs[i][dim_y];
+    if (ter_is(m, x, y, ter_water) && region_at(m, region_swim, x, y)) {
+      water[n++] = region_at(m, region_swim, x, y);
+    }
+  }
+
+  if (!n) {
+    return;
+  }
+
+  if (world.lod) {
+    shadowcast(m, world.pc.pos, SWIM_CLASS, seen);
+  } else {
+    /* Full fidelity (-f) keeps the line of sight swimmers had before *
+     * this field existed, can_see() from each swimmable cell, so that *
+     * swimmers behave as they always did and runs stay comparable.    */
+    memset(seen, 0, sizeof (seen));
+    for (p[dim_y] = 1; p[dim_y] < MAP_Y - 1; p[dim_y]++) {
+      for (p[dim_x] = 1; p[dim_x] < MAP_X - 1; p[dim_x]++) {
+        if (region_at(m, region_swim, p[dim_x], p[dim_y]) &&
+            can_see(m, p, world.pc.pos, SWIM_CLASS)) {
+          seen[p[dim_y]] |= row_bit(p[dim_x]);
+        }
+      }
+    }
+  }
+
+  for (y = 1; y < MAP_Y - 1; y++) {
+    for (r = seen[y]; r; r &= r - 1) {
+      x = row_ctz(r);
+      for (j = 0; j < n; j++) {
+        if (region_at(m, region_swim, x, y) == water[j]) {
+          world.swim_view[y] |= row_bit(x);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/* True if the PC, at pc, is close enough to or in view of the NPC at *
+ * pos.  Never true when the PC isn't on the map at all.              */
+static bool pc_nearby(map *m, const int16_t *pc, const pair_t pos)
+{
+  return (pc &&
+          ((abs(pos[dim_x] - pc[dim_x]) <= NPC_WAKE_DIST &&
+            abs(pos[dim_y] - pc[dim_y]) <= NPC_WAKE_DIST) ||
+           can_see(m, pos, pc, SIGHT_CLASS)));
+}
+
+static void move_hiker_func(sim_t *s, char_id_t c, pair_t dest)
+{
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c];
   int min;
   int base;
   int i;
   
-  base = rand() & 0x7;
+  base = sim_rand(s) & 0x7;
+
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
+
+  /* Nobody to chase until the PC comes back */
+  if (!s->pc) {
+    npc_sleep(m, c);
+    return;
+  }
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
   min = DIJKSTRA_PATH_MAX;
   
   for (i = base; i < 8 + base; i++) {
-    if ((world.hiker_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                         [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] <=
+    if ((s->hiker_dist[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[i & 0x7][dim_x]] <=
          min) &&
-        !world.cur_map->cmap[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                            [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] &&
-        c->pos[dim_x] + all_dirs[i & 0x7][dim_x] != 0 &&
-        c->pos[dim_x] + all_dirs[i & 0x7][dim_x] != MAP_X - 1 &&
-        c->pos[dim_y] + all_dirs[i & 0x7][dim_y] != 0 &&
-        c->pos[dim_y] + all_dirs[i & 0x7][dim_y] != MAP_Y - 1) {
-      dest[dim_x] = c->pos[dim_x] + all_dirs[i & 0x7][dim_x];
-      dest[dim_y] = c->pos[dim_y] + all_dirs[i & 0x7][dim_y];
-      min = world.hiker_dist[dest[dim_y]][dest[dim_x]];
-    }
-    if (world.hiker_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                        [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
-      io_battle(c, &world.pc);
+        !m->cmap[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                [pos[dim_x] + all_dirs[i & 0x7][dim_x]] &&
+        pos[dim_x] + all_dirs[i & 0x7][dim_x] != 0 &&
+        pos[dim_x] + all_dirs[i & 0x7][dim_x] != MAP_X - 1 &&
+        pos[dim_y] + all_dirs[i & 0x7][dim_y] != 0 &&
+        pos[dim_y] + all_dirs[i & 0x7][dim_y] != MAP_Y - 1) {
+      dest[dim_x] = pos[dim_x] + all_dirs[i & 0x7][dim_x];
+      dest[dim_y] = pos[dim_y] + all_dirs[i & 0x7][dim_y];
+      min = s->hiker_dist[dest[dim_y]][dest[dim_x]];
+    }
+    if (s->hiker_dist[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                        [pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
+      io_battle(m, c);
       break;
     }
   }
 }
 
-static void move_rival_func(character *c, pair_t dest)
+static void move_rival_func(sim_t *s, char_id_t c, pair_t dest)
 {
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c];
   int min;
   int base;
   int i;
   
-  base = rand() & 0x7;
+  base = sim_rand(s) & 0x7;
+
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
+
+  /* Nobody to chase until the PC comes back */
+  if (!s->pc) {
+    npc_sleep(m, c);
+    return;
+  }
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
   min = DIJKSTRA_PATH_MAX;
   
   for (i = base; i < 8 + base; i++) {
-    if ((world.rival_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                         [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] <
+    if ((s->rival_dist[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[i & 0x7][dim_x]] <
          min) &&
-        !world.cur_map->cmap[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                            [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] &&
-        c->pos[dim_x] + all_dirs[i & 0x7][dim_x] != 0 &&
-        c->pos[dim_x] + all_dirs[i & 0x7][dim_x] != MAP_X - 1 &&
-        c->pos[dim_y] + all_dirs[i & 0x7][dim_y] != 0 &&
-        c->pos[dim_y] + all_dirs[i & 0x7][dim_y] != MAP_Y - 1) {
-      dest[dim_x] = c->pos[dim_x] + all_dirs[i & 0x7][dim_x];
-      dest[dim_y] = c->pos[dim_y] + all_dirs[i & 0x7][dim_y];
-      min = world.rival_dist[dest[dim_y]][dest[dim_x]];
-    }
-    if (world.rival_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                        [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
-      io_battle(c, &world.pc);
+        !m->cmap[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                [pos[dim_x] + all_dirs[i & 0x7][dim_x]] &&
+        pos[dim_x] + all_dirs[i & 0x7][dim_x] != 0 &&
+        pos[dim_x] + all_dirs[i & 0x7][dim_x] != MAP_X - 1 &&
+        pos[dim_y] + all_dirs[i & 0x7][dim_y] != 0 &&
+        pos[dim_y] + all_dirs[i & 0x7][dim_y] != MAP_Y - 1) {
+      dest[dim_x] = pos[dim_x] + all_dirs[i & 0x7][dim_x];
+      dest[dim_y] = pos[dim_y] + all_dirs[i & 0x7][dim_y];
+      min = s->rival_dist[dest[dim_y]][dest[dim_x]];
+    }
+    if (s->rival_dist[pos[dim_y] + all_dirs[i & 0x7][dim_y]]
+                        [pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
+      io_battle(m, c);
       break;
     }
   }
 }
 
-static void move_pacer_func(character *c, pair_t dest)
+static void move_pacer_func(sim_t *s, char_id_t c, pair_t dest)
 {
-  terrain_type_t t;
-  npc *n = dynamic_cast<npc *> (c);
+  map *m = s->m;
+  bool open;
+  int16_t *pos = m->npc.pos[c], *dir = m->npc.dir[c];
   
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
-
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-      &world.pc) {
-      io_battle(c, &world.pc);
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
+
+  /* Nothing left to do but wander about out of sight */
+  if (m->npc.defeated[c] && !pc_nearby(m, s->pc, pos)) {
+    npc_sleep(m, c);
+    return;
+  }
+
+  if (!m->npc.defeated[c] &&
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]] == CHAR_PC) {
+      io_battle(m, c);
       return;
   }
 
-  t = world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                        [c->pos[dim_x] + n->dir[dim_x]];
+  open = nbr_is(m, nbr_pace, pos[dim_x], pos[dim_y], dir);
 
-  if ((t != ter_path && t != ter_grass && t != ter_clearing) ||
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]]) {
-    n->dir[dim_x] *= -1;
-    n->dir[dim_y] *= -1;
+  if (!open ||
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    dir[dim_x] *= -1;
+    dir[dim_y] *= -1;
   }
 
-  if ((t == ter_path || t == ter_grass || t == ter_clearing) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+  if (open &&
+      !m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_wanderer_func(character *c, pair_t dest)
+static void move_wanderer_func(sim_t *s, char_id_t c, pair_t dest)
 {
-  npc *n = dynamic_cast<npc *> (c);
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c], *dir = m->npc.dir[c];
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
 
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-      &world.pc) {
-      io_battle(c, &world.pc);
+  /* Nothing left to do but wander about out of sight */
+  if (m->npc.defeated[c] && !pc_nearby(m, s->pc, pos)) {
+    npc_sleep(m, c);
+    return;
+  }
+
+  if (!m->npc.defeated[c] &&
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]] == CHAR_PC) {
+      io_battle(m, c);
       return;
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] !=
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) ||
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]]) {
-    rand_dir(n->dir);
+  if ((ter_at(m, pos[dim_x] + dir[dim_x],
+              pos[dim_y] + dir[dim_y]) !=
+       ter_at(m, pos[dim_x], pos[dim_y])) ||
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    sim_rand_dir(s, dir);
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+  if ((ter_at(m, pos[dim_x] + dir[dim_x],
+              pos[dim_y] + dir[dim_y]) ==
+       ter_at(m, pos[dim_x], pos[dim_y])) &&
+      !m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_sentry_func(character *c, pair_t dest)
+static void move_sentry_func(sim_t *s, char_id_t c, pair_t dest)
 {
+  map *m = s->m;
+
   // Not a bug.  Sentries are non-aggro.
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = m->npc.pos[c][dim_x];
+  dest[dim_y] = m->npc.pos[c][dim_y];
+
+  /* And so they may as well sleep on the job */
+  npc_sleep(m, c);
 }
 
-static void move_explorer_func(character *c, pair_t dest)
+static void move_explorer_func(sim_t *s, char_id_t c, pair_t dest)
 {
-  npc *n = dynamic_cast<npc *> (c);
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c], *dir = m->npc.dir[c];
+
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  /* Nothing left to do but wander about out of sight */
+  if (m->npc.defeated[c] && !pc_nearby(m, s->pc, pos)) {
+    npc_sleep(m, c);
+    return;
+  }
 
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-      &world.pc) {
-      io_battle(c, &world.pc);
+  if (!m->npc.defeated[c] &&
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]] == CHAR_PC) {
+      io_battle(m, c);
       return;
   }
 
-  if ((move_cost[char_other][world.cur_map->map[c->pos[dim_y] +
-                                                n->dir[dim_y]]
-                                               [c->pos[dim_x] +
-                                                n->dir[dim_x]]] ==
-       DIJKSTRA_PATH_MAX) || (world.cur_map->cmap[c->pos[dim_y] +
-                                                  n->dir[dim_y]]
-                              [c->pos[dim_x] + n->dir[dim_x]])) {
-    rand_dir(n->dir);
+  if (!nbr_is(m, nbr_explore, pos[dim_x], pos[dim_y], dir) ||
+      m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    sim_rand_dir(s, dir);
   }
 
-  if ((move_cost[char_other][world.cur_map->map[c->pos[dim_y] +
-                                                n->dir[dim_y]]
-                                               [c->pos[dim_x] +
-                                                n->dir[dim_x]]] !=
-       DIJKSTRA_PATH_MAX) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+  if (nbr_is(m, nbr_explore, pos[dim_x], pos[dim_y], dir) &&
+      !m->cmap[pos[dim_y] + dir[dim_y]][pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_swimmer_func(character *c, pair_t dest)
+static void move_swimmer_func(sim_t *s, char_id_t c, pair_t dest)
 {
-  map *m = world.cur_map;
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c];
   pair_t dir; 
-  npc *n = dynamic_cast<npc *> (c);
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
 
-  if (is_adjacent(world.pc.pos, ter_water) &&
-      can_see(world.cur_map, c, &world.pc)) {
+  if (s->swim_view && row_test(s->swim_view[pos[dim_y]], pos[dim_x])) {
     /* PC is next to this body of water; swim to the PC */
 
-    dir[dim_x] = world.pc.pos[dim_x] - c->pos[dim_x];
+    dir[dim_x] = s->pc[dim_x] - pos[dim_x];
     if (dir[dim_x]) {
       dir[dim_x] /= abs(dir[dim_x]);
     }
-    dir[dim_y] = world.pc.pos[dim_y] - c->pos[dim_y];
+    dir[dim_y] = s->pc[dim_y] - pos[dim_y];
     if (dir[dim_y]) {
       dir[dim_y] /= abs(dir[dim_y]);
     }
 
-    if ((m->map[dest[dim_y] + dir[dim_y]]
-               [dest[dim_x] + dir[dim_x]] == ter_water) ||
-        ((m->map[dest[dim_y] + dir[dim_y]]
-                [dest[dim_x] + dir[dim_x]] == ter_path) &&
-         is_adjacent(((pair_t){ (int16_t) (dest[dim_x] + dir[dim_x]),
-                               (int16_t) (dest[dim_y] + dir[dim_y]) }),
-           ter_water))) {
+    if (ter_is(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y],
+               ter_water) ||
+        is_bridge(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y])) {
       dest[dim_x] += dir[dim_x];
       dest[dim_y] += dir[dim_y];
-    } else if ((m->map[dest[dim_y]][dest[dim_x] + dir[dim_x]] == ter_water) ||
-               ((m->map[dest[dim_y]][dest[dim_x] + dir[dim_x]] == ter_path) &&
-                is_adjacent(((pair_t){ (int16_t) (dest[dim_x] + dir[dim_x]),
-                                       (int16_t) (dest[dim_y]) }),
-                  ter_water))) {
+    } else if (ter_is(m, dest[dim_x] + dir[dim_x], dest[dim_y], ter_water) ||
+               is_bridge(m, dest[dim_x] + dir[dim_x], dest[dim_y])) {
       dest[dim_x] += dir[dim_x];
-    } else if ((m->map[dest[dim_y] + dir[dim_y]][dest[dim_x]] == ter_water) ||
-               ((m->map[dest[dim_y] + dir[dim_y]][dest[dim_x]] == ter_path) &&
-                is_adjacent(((pair_t){ (int16_t) (dest[dim_x]),
-                                       (int16_t) (dest[dim_y] + dir[dim_y]) }),
-                            ter_water))) {
+    } else if (ter_is(m, dest[dim_x], dest[dim_y] + dir[dim_y], ter_water) ||
+               is_bridge(m, dest[dim_x], dest[dim_y] + dir[dim_y])) {
       dest[dim_y] += dir[dim_y];
     }
   } else {
     /* PC is elsewhere.  Keep doing laps. */
-    dir[dim_x] = n->dir[dim_x];
-    dir[dim_y] = n->dir[dim_y];
-    if ((m->map[dest[dim_y] + dir[dim_y]]
-                    [dest[dim_x] + dir[dim_x]] != ter_water) ||
-        !((m->map[dest[dim_y] + dir[dim_y]]
-                 [dest[dim_x] + dir[dim_x]] == ter_path) &&
-          is_adjacent(((pair_t) { (int16_t) (dest[dim_x] + dir[dim_x]),
-                                  (int16_t) (dest[dim_y] + dir[dim_y]) }),
-            ter_water))) {
-      rand_dir(dir);
-    }
-
-    if ((m->map[dest[dim_y] + dir[dim_y]]
-                    [dest[dim_x] + dir[dim_x]] == ter_water) ||
-        ((m->map[dest[dim_y] + dir[dim_y]]
-                [dest[dim_x] + dir[dim_x]] == ter_path) &&
-         is_adjacent(((pair_t) { (int16_t) (dest[dim_x] + dir[dim_x]),
-                                 (int16_t) (dest[dim_y] + dir[dim_y]) }),
-           ter_water))) {
+    dir[dim_x] = m->npc.dir[c][dim_x];
+    dir[dim_y] = m->npc.dir[c][dim_y];
+    if (!ter_is(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y],
+                ter_water) ||
+        !is_bridge(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y])) {
+      sim_rand_dir(s, dir);
+    }
+
+    if (ter_is(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y],
+               ter_water) ||
+        is_bridge(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y])) {
       dest[dim_x] += dir[dim_x];
       dest[dim_y] += dir[dim_y];
     }
@@ -374,18 +520,18 @@ static void move_swimmer_func(character *c, pair_t dest)
 
   if (m->cmap[dest[dim_y]][dest[dim_x]]) {
     /* Occupied.  Just be patient. */
-    dest[dim_x] = c->pos[dim_x];
-    dest[dim_y] = c->pos[dim_y];
+    dest[dim_x] = pos[dim_x];
+    dest[dim_y] = pos[dim_y];
   }
 }
 
-static void move_pc_func(character *c, pair_t dest)
+static void move_pc_func(sim_t *s, char_id_t c, pair_t dest)
 {
   io_display();
   io_handle_input(dest);
 }
 
-void (*move_func[num_movement_types])(character *, pair_t) = {
+void (*move_func[num_movement_types])(sim_t *, char_id_t, pair_t) = {
   move_hiker_func,
   move_rival_func,
   move_pacer_func,
@@ -396,24 +542,143 @@ void (*move_func[num_movement_types])(character *, pair_t) = {
   move_pc_func,
 };
 
+/* With the PC off the map, nobody can tell whether an NPC took its steps  *
+ * one at a time or several together.  The movers here take the same first *
+ * step as the exact ones, then keep going in a straight line for as long  *
+ * as the exact mover would have (a move it makes without consulting       *
+ * rand()) and the NPC still has time before s->until, all without a trip  *
+ * through the turn queue.  Every cell but the last is charged here;       *
+ * step_npc charges the last as usual.  The only difference from exact     *
+ * movement is the interleaving with other NPCs' moves.  The PC's own map  *
+ * never gets this, however far away an NPC is: all of it is on screen, so *
+ * there's no distance at which a jump would go unseen, and catching up    *
+ * once the PC came near would show as NPCs teleporting.                   */
+static void lod_run(sim_t *s, char_id_t c, pair_t dest, uint32_t open)
+{
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c], *dir = m->npc.dir[c];
+  int32_t t;
+
+  if (dest[dim_x] == pos[dim_x] && dest[dim_y] == pos[dim_y]) {
+    return;
+  }
+
+  for (t = m->npc.next_turn[c] +
+         move_cost[m->npc.ctype[c]][ter_at(m, dest[dim_x], dest[dim_y])];
+       (t < s->until &&
+        ter_in(m, dest[dim_x] + dir[dim_x], dest[dim_y] + dir[dim_y], open) &&
+        !m->cmap[dest[dim_y] + dir[dim_y]][dest[dim_x] + dir[dim_x]]); ) {
+    m->npc.next_turn[c] +=
+      move_cost[m->npc.ctype[c]][ter_at(m, dest[dim_x], dest[dim_y])];
+    dest[dim_x] += dir[dim_x];
+    dest[dim_y] += dir[dim_y];
+    t = m->npc.next_turn[c] +
+      move_cost[m->npc.ctype[c]][ter_at(m, dest[dim_x], dest[dim_y])];
+  }
+}
+
+static void lod_pacer_func(sim_t *s, char_id_t c, pair_t dest)
+{
+  move_pacer_func(s, c, dest);
+  lod_run(s, c, dest, PACE_CLASS);
+}
+
+static void lod_wanderer_func(sim_t *s, char_id_t c, pair_t dest)
+{
+  move_wanderer_func(s, c, dest);
+  lod_run(s, c, dest, ter_mask(ter_at(s->m, dest[dim_x], dest[dim_y])));
+}
+
+static void lod_explorer_func(sim_t *s, char_id_t c, pair_t dest)
+{
+  uint32_t open;
+  int t;
+
+  move_explorer_func(s, c, dest);
+  for (open = t = 0; t < num_terrain_types; t++) {
+    if (nbr_in(nbr_explore, (terrain_type_t) t)) {
+      open |= ter_mask(t);
+    }
+  }
+  lod_run(s, c, dest, open);
+}
+
+void (*lod_func[num_movement_types])(sim_t *, char_id_t, pair_t) = {
+  move_hiker_func,
+  move_rival_func,
+  lod_pacer_func,
+  lod_wanderer_func,
+  move_sentry_func,
+  lod_explorer_func,
+  move_swimmer_func,
+  move_pc_func,
+};
+
+static inline int32_t char_next_turn(const map *m, char_id_t c)
+{
+  return c == CHAR_PC ? world.pc.next_turn : m->npc.next_turn[c];
+}
+
+static inline int32_t char_seq_num(const map *m, char_id_t c)
+{
+  return c == CHAR_PC ? world.pc.seq_num : m->npc.seq_num[c];
+}
+
+thread_local map *turn_map;
+
+/* A turn queue only ever holds handles for its own map */
 int32_t cmp_char_turns(const void *key, const void *with)
 {
-  return ((((character *) key)->next_turn ==
-           ((character *) with)->next_turn)  ?
-          (((character *) key)->seq_num -
-           ((character *) with)->seq_num)    :
-          (((character *) key)->next_turn -
-           ((character *) with)->next_turn));
+  const map *m = turn_map ? turn_map : world.cur_map;
+  char_id_t k = datum_turn(key), w = datum_turn(with);
+
+  return ((char_next_turn(m, k) == char_next_turn(m, w)) ?
+          (char_seq_num(m, k) - char_seq_num(m, w))      :
+          (char_next_turn(m, k) - char_next_turn(m, w)));
+}
+
+void npc_schedule(map *m, char_id_t c)
+{
+  m->npc.hn[c] = heap_insert(&m->turn, turn_datum(c));
+}
+
+/* Takes c out of the turn queue until wake_npcs() says otherwise */
+void npc_sleep(map *m, char_id_t c)
+{
+  if (m->npc.hn[c]) {
+    heap_remove(&m->turn, m->npc.hn[c]);
+    m->npc.hn[c] = NULL;
+  }
+  m->npc.dormant[c] = 1;
+  m->dormant[m->npc.pos[c][dim_y]] |= row_bit(m->npc.pos[c][dim_x]);
 }
 
-void delete_character(void *v)
+/* Returns dormant NPCs near or in view of the PC to the turn queue, or *
+ * all of them when the PC has just arrived on the map.  They pick up  *
+ * at the PC's time rather than catching up on the turns they slept    *
+ * through.  Anything that still has nothing to do goes back to sleep  *
+ * on its next turn.                                                   */
+void wake_npcs(map *m, int all)
 {
-  if (v != &world.pc) {
-    delete (character *) v;
+  row_t r;
+  char_id_t c;
+  int32_t x, y;
+
+  for (y = 1; y < MAP_Y - 1; y++) {
+    for (r = m->dormant[y]; r; r &= r - 1) {
+      x = row_ctz(r);
+      c = m->cmap[y][x];
+      if (all || pc_nearby(m, world.pc.pos, m->npc.pos[c])) {
+        m->dormant[y] &= ~row_bit(x);
+        m->npc.dormant[c] = 0;
+        m->npc.next_turn[c] = world.pc.next_turn;
+        npc_schedule(m, c);
+      }
+    }
   }
 }
 
-#define ter_cost(x, y, c) move_cost[c][m->map[y][x]]
+#define ter_cost(x, y, c) move_cost[c][ter_at(m, x, y)]
 
 static int32_t hiker_cmp(const void *key, const void *with) {
   return (world.hiker_dist[((path_t *) key)->pos[dim_y]]
@@ -435,6 +700,7 @@ void pathfind(map *m)
   uint16_t x, y;
   static path_t p[MAP_Y][MAP_X], *c;
   static uint32_t initialized = 0;
+  PROF_SCOPE(prof_pathfind);
 
   if (!initialized) {
     initialized = 1;
@@ -456,6 +722,7 @@ void pathfind(map *m)
     world.rival_dist[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = 0;
 
   heap_init(&h, hiker_cmp, NULL);
+  PROF_HEAP(&h, prof_heap(prof_heap_pathfind));
 
   for (y = 1; y < MAP_Y - 1; y++) {
     for (x = 1; x < MAP_X - 1; x++) {
@@ -557,6 +824,7 @@ void pathfind(map *m)
   heap_delete(&h);
 
   heap_init(&h, rival_cmp, NULL);
+  PROF_HEAP(&h, prof_heap(prof_heap_pathfind));
 
   for (y = 1; y < MAP_Y - 1; y++) {
     for (x = 1; x < MAP_X - 1; x++) {
@@ -657,3 +925,129 @@ void pathfind(map *m)
   }
   heap_delete(&h);
 }
+
+static int32_t path_cost_cmp(const void *key, const void *with) {
+  return ((path_t *) key)->cost - ((path_t *) with)->cost;
+}
+
+/* Fills dist with what it costs the PC to walk from each interior cell *
+ * to the nearest cell set in target.  A single Dijkstra run seeded     *
+ * with every target at once, so it costs no more than pathfind()      *
+ * however many there are.  As in the game loop, each step costs the   *
+ * terrain stepped onto.  Border cells are never stepped through, but   *
+ * gates may be targets; they are only entered straight on.  Cells that *
+ * can't get there are left at DIJKSTRA_PATH_MAX.                       */
+void pc_dist_to_cells(const map *m, const row_t target[MAP_Y],
+                      int dist[MAP_Y][MAP_X])
+{
+  heap_t h;
+  int16_t x, y, nx, ny;
+  int32_t i, d, edge;
+  static path_t p[MAP_Y][MAP_X];
+  path_t *c;
+
+  heap_init(&h, path_cost_cmp, NULL);
+  PROF_HEAP(&h, prof_heap(prof_heap_dist));
+
+  for (y = 0; y < MAP_Y; y++) {
+    for (x = 0; x < MAP_X; x++) {
+      dist[y][x] = DIJKSTRA_PATH_MAX;
+      p[y][x].hn = NULL;
+      p[y][x].pos[dim_y] = y;
+      p[y][x].pos[dim_x] = x;
+      if (ter_cost(x, y, char_pc) == DIJKSTRA_PATH_MAX) {
+        continue;
+      }
+      edge = !x || !y || x == MAP_X - 1 || y == MAP_Y - 1;
+      if (row_test(target[y], x)) {
+        p[y][x].cost = dist[y][x] = 0;
+        p[y][x].hn = heap_insert(&h, &p[y][x]);
+      } else if (!edge) {
+        p[y][x].cost = DIJKSTRA_PATH_MAX;
+        p[y][x].hn = heap_insert(&h, &p[y][x]);
+      }
+    }
+  }
+
+  while ((c = (path_t *) heap_remove_min(&h))) {
+    c->hn = NULL;
+    if (c->cost == DIJKSTRA_PATH_MAX) {
+      break;
+    }
+    d = c->cost + ter_cost(c->pos[dim_x], c->pos[dim_y], char_pc);
+    edge = (!c->pos[dim_x] || !c->pos[dim_y] ||
+            c->pos[dim_x] == MAP_X - 1 || c->pos[dim_y] == MAP_Y - 1);
+    for (i = 0; i < 8; i++) {
+      if (edge && all_dirs[i][dim_x] && all_dirs[i][dim_y]) {
+        continue;
+      }
+      nx = c->pos[dim_x] + all_dirs[i][dim_x];
+      ny = c->pos[dim_y] + all_dirs[i][dim_y];
+      if (nx >= 0 && nx < MAP_X && ny >= 0 && ny < MAP_Y &&
+          p[ny][nx].hn && p[ny][nx].cost > d) {
+        p[ny][nx].cost = dist[ny][nx] = d;
+        heap_decrease_key_no_replace(&h, p[ny][nx].hn);
+      }
+    }
+  }
+  heap_delete(&h);
+}
+
+/* As pc_dist_to_cells(), to the nearest cell whose terrain is in cls, *
+ * a set of ter_mask()s.                                               */
+void pc_dist_to(const map *m, uint32_t cls, int dist[MAP_Y][MAP_X])
+{
+  row_t target[MAP_Y];
+  int32_t y;
+
+  for (y = 0; y < MAP_Y; y++) {
+    target[y] = ter_row(m, cls, y);
+  }
+
+  pc_dist_to_cells(m, target, dist);
+}
+
+/* Spreads each set bit of r to its left and right neighbors */
+#define row_spread(r) ((r) | ((r) << 1) | ((r) >> 1))
+
+/* Marks in reach every interior cell connected to (x, y) through cells *
+ * set in pass, using eight-way connectivity; exactly those cells that  *
+ * pathfind() would give a finite distance.  Works a whole row at a     *
+ * time: a row grows into whatever its own bits and its neighbors' bits *
+ * touch, masked by what's passable.  Alternating downward and upward   *
+ * sweeps until nothing changes takes a handful of passes on real maps. */
+void flood_fill(const row_t pass[MAP_Y], int16_t x, int16_t y,
+                row_t reach[MAP_Y])
+{
+  row_t grown;
+  int32_t i;
+  int changed;
+
+  memset(reach, 0, MAP_Y * sizeof (*reach));
+  reach[y] = row_bit(x);
+
+  /* As in pathfind(), nothing spreads out of an impassable start */
+  if (!row_test(pass[y], x)) {
+    return;
+  }
+
+  do {
+    changed = 0;
+    for (i = 1; i < MAP_Y - 1; i++) {
+      grown = (row_spread(reach[i - 1]) | row_spread(reach[i]) |
+               row_spread(reach[i + 1])) & pass[i] & ROW_INTERIOR;
+      if (grown & ~reach[i]) {
+        reach[i] |= grown;
+        changed = 1;
+      }
+    }
+    for (i = MAP_Y - 2; i > 0; i--) {
+      grown = (row_spread(reach[i - 1]) | row_spread(reach[i]) |
+               row_spread(reach[i + 1])) & pass[i] & ROW_INTERIOR;
+      if (grown & ~reach[i]) {
+        reach[i] |= grown;
+        changed = 1;
+      }
+    }
+  } while (changed);
+}
@@ -30,35 +30,35 @@ typedef enum __attribute__ ((__packed__)) character_type {
 
 extern const char *char_type_name[num_character_types];
 
-class character {
+/* Characters are named by small integer handles.  That's what cmap    *
+ * holds and what goes in the turn queue.  The PC has a handle of its   *
+ * own; NPC handles index their map's npc_store (see poke327.h).        */
+typedef uint16_t char_id_t;
+
+# define CHAR_NONE 0
+# define CHAR_PC   1
+# define NPC_FIRST 2
+
+/* Handles as turn queue data, which the heap wants as pointers */
+# define turn_datum(c) ((void *) (uintptr_t) (c))
+# define datum_turn(v) ((char_id_t) (uintptr_t) (v))
+
+class pc {
  public:
-  virtual ~character() {}
   pair_t pos;
   char symbol;
   int next_turn;
   int seq_num;
 };
 
-class npc : public character {
- public:
-  character_type_t ctype;
-  movement_type_t mtype;
-  int defeated;
-  pair_t dir;
-};
-
-class pc : public character {
-};
-
-/* character is defined in poke327.h to allow an instance of character
- * in world without including character.h in poke327.h                 */
+class map;
+typedef struct sim sim_t;
 
 int32_t cmp_char_turns(const void *key, const void *with);
-void delete_character(void *v);
 
-extern void (*move_func[num_movement_types])(character *, pair_t);
+extern void (*move_func[num_movement_types])(sim_t *, char_id_t, pair_t);
+extern void (*lod_func[num_movement_types])(sim_t *, char_id_t, pair_t);
 
 int pc_move(char);
-bool is_pc(character *c);
 
 #endif
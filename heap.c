@@ -42,6 +42,48 @@ struct heap_node {
   (n)->prev->next = (n)->next;           \
 })
 
+/* Bumps a counter in h's stats, if it has any */
+#define heap_count(h, field) ({ \
+  if ((h)->stats) {             \
+    (h)->stats->field++;        \
+  }                             \
+})
+
+/* Freed nodes go onto a per-thread free list instead of back to the *
+ * allocator.  Pathfinding pushes every cell of a map through a heap, *
+ * so once the list is warm, heap traffic never touches malloc.       */
+static _Thread_local heap_node_t *free_nodes;
+
+static heap_node_t *heap_node_alloc(void)
+{
+  heap_node_t *n;
+
+  if ((n = free_nodes)) {
+    free_nodes = n->next;
+    memset(n, 0, sizeof (*n));
+  } else {
+    assert((n = calloc(1, sizeof (*n))));
+  }
+
+  return n;
+}
+
+static void heap_node_free(heap_node_t *n)
+{
+  n->next = free_nodes;
+  free_nodes = n;
+}
+
+void heap_cache_release(void)
+{
+  heap_node_t *n;
+
+  while ((n = free_nodes)) {
+    free_nodes = n->next;
+    free(n);
+  }
+}
+
 void print_heap_node(heap_node_t *n, unsigned indent,
                      char *(*print)(const void *v))
 {
@@ -99,6 +141,67 @@ void heap_init(heap_t *h,
   h->size = 0;
   h->compare = compare;
   h->datum_delete = datum_delete;
+  h->stats = NULL;
+}
+
+/* Starts counting h's work in s, which isn't cleared first so that *
+ * several heaps, or several lifetimes of one, can add up in it.     */
+void heap_stats_attach(heap_t *h, heap_stats_t *s)
+{
+  h->stats = s;
+}
+
+void heap_stats_merge(heap_stats_t *into, const heap_stats_t *from)
+{
+  uint32_t i;
+
+  into->inserts += from->inserts;
+  into->remove_mins += from->remove_mins;
+  into->decrease_keys += from->decrease_keys;
+  into->removes += from->removes;
+  into->consolidations += from->consolidations;
+  into->links += from->links;
+  into->cuts += from->cuts;
+  into->cascading_cuts += from->cascading_cuts;
+  if (from->max_roots > into->max_roots) {
+    into->max_roots = from->max_roots;
+  }
+  if (from->max_size > into->max_size) {
+    into->max_size = from->max_size;
+  }
+  for (i = 0; i < HEAP_MAX_DEGREE; i++) {
+    into->degree[i] += from->degree[i];
+  }
+}
+
+/* One line of counts, each divided by per (say, the number of turns *
+ * they were spent on), then the degree distribution as percentages. */
+void heap_stats_print(FILE *f, const char *name, const heap_stats_t *s,
+                      uint64_t per)
+{
+  uint64_t roots;
+  uint32_t i;
+  double d;
+
+  d = per ? per : 1;
+  fprintf(f, "%-17s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %6u %8u\n",
+          name, s->inserts / d, s->remove_mins / d, s->decrease_keys / d,
+          s->consolidations / d, s->links / d, s->cuts / d,
+          s->cascading_cuts / d, s->max_roots, s->max_size);
+
+  for (roots = 0, i = 0; i < HEAP_MAX_DEGREE; i++) {
+    roots += s->degree[i];
+  }
+  if (!roots) {
+    return;
+  }
+  fprintf(f, "%-17s", "  root degrees");
+  for (i = 0; i < HEAP_MAX_DEGREE; i++) {
+    if (s->degree[i]) {
+      fprintf(f, " %u:%.1f%%", i, 100.0 * s->degree[i] / roots);
+    }
+  }
+  fprintf(f, "\n");
 }
 
 void heap_node_delete(heap_t *h, heap_node_t *hn)
@@ -114,7 +217,7 @@ void heap_node_delete(heap_t *h, heap_node_t *hn)
     if (h->datum_delete) {
       h->datum_delete(hn->datum);
     }
-    free(hn);
+    heap_node_free(hn);
     hn = next;
   }
 }
@@ -134,7 +237,7 @@ heap_node_t *heap_insert(heap_t *h, void *v)
 {
   heap_node_t *n;
 
-  assert((n = calloc(1, sizeof (*n))));
+  n = heap_node_alloc();
   n->datum = v;
 
   if (h->min) {
@@ -147,6 +250,13 @@ heap_node_t *heap_insert(heap_t *h, void *v)
   }
   h->size++;
 
+  if (h->stats) {
+    h->stats->inserts++;
+    if (h->size > h->stats->max_size) {
+      h->stats->max_size = h->size;
+    }
+  }
+
   return n;
 }
 
@@ -167,11 +277,12 @@ static void heap_link(heap_t *h, heap_node_t *node, heap_node_t *root)
   node->parent = root;
   root->degree++;
   node->mark = 0;
+  heap_count(h, links);
 }
 
 static void heap_consolidate(heap_t *h)
 {
-  uint32_t i;
+  uint32_t i, roots;
   heap_node_t *x, *y, *n;
   heap_node_t *a[64]; /* Need ceil(lg(h->size)), so this is good  *
                        * to the limit of a 64-bit address space,  *
@@ -181,7 +292,7 @@ static void heap_consolidate(heap_t *h)
 
   h->min->prev->next = NULL;
 
-  for (x = n = h->min; n; x = n) {
+  for (roots = 0, x = n = h->min; n; x = n, roots++) {
     n = n->next;
 
     while (a[x->degree]) {
@@ -195,6 +306,16 @@ static void heap_consolidate(heap_t *h)
     a[x->degree] = x;
   }
 
+  if (h->stats) {
+    h->stats->consolidations++;
+    if (roots > h->stats->max_roots) {
+      h->stats->max_roots = roots;
+    }
+    for (i = 0; i < 64; i++) {
+      h->stats->degree[i] += !!a[i];
+    }
+  }
+
   for (h->min = NULL, i = 0; i < 64; i++) {
     if (a[i]) {
       if (h->min) {
@@ -218,9 +339,10 @@ void *heap_remove_min(heap_t *h)
   v = NULL;
 
   if (h->min) {
+    heap_count(h, remove_mins);
     v = h->min->datum;
     if (h->size == 1) {
-      free(h->min);
+      heap_node_free(h->min);
       h->min = NULL;
     } else {
       if ((n = h->min->child)) {
@@ -234,7 +356,7 @@ void *heap_remove_min(heap_t *h)
       n = h->min;
       remove_heap_node_from_list(n);
       h->min = n->next;
-      free(n);
+      heap_node_free(n);
 
       heap_consolidate(h);
     }
@@ -254,6 +376,7 @@ int heap_combine(heap_t *h, heap_t *h1, heap_t *h2)
 
   h->compare = h1->compare;
   h->datum_delete = h1->datum_delete;
+  h->stats = h1->stats;
 
   if (!h1->min) {
     h->min = h2->min;
@@ -286,6 +409,7 @@ static void heap_cut(heap_t *h, heap_node_t *n, heap_node_t *p)
   n->parent = NULL;
   n->mark = 0;
   insert_heap_node_in_list(n, h->min);
+  heap_count(h, cuts);
 }
 
 static void heap_cascading_cut(heap_t *h, heap_node_t *n)
@@ -297,6 +421,7 @@ static void heap_cascading_cut(heap_t *h, heap_node_t *n)
       n->mark = 1;
     } else {
       heap_cut(h, n, p);
+      heap_count(h, cascading_cuts);
       heap_cascading_cut(h, p);
     }
   }
@@ -325,6 +450,8 @@ int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n)
 
   heap_node_t *p;
 
+  heap_count(h, decrease_keys);
+
   p = n->parent;
 
   if (p && (h->compare(n->datum, p->datum) < 0)) {
@@ -338,6 +465,24 @@ int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n)
   return 0;
 }
 
+/* Removes n from wherever it is in the heap and returns its datum.  As *
+ * if its key had dropped below everything else: cut it up to the root *
+ * list, make it the min, and take the min.                             */
+void *heap_remove(heap_t *h, heap_node_t *n)
+{
+  heap_node_t *p;
+
+  heap_count(h, removes);
+
+  if ((p = n->parent)) {
+    heap_cut(h, n, p);
+    heap_cascading_cut(h, p);
+  }
+  h->min = n;
+
+  return heap_remove_min(h);
+}
+
 #ifdef TESTING
 
 int32_t compare(const void *key, const void *with)
@@ -357,6 +502,7 @@ char *print_int(const void *v)
 int main(int argc, char *argv[])
 {
   heap_t h;
+  heap_stats_t s;
   int **keys;
   heap_node_t **a;
   /*  int *p;*/
@@ -373,6 +519,8 @@ int main(int argc, char *argv[])
   assert((a = calloc(n, sizeof (*a))));
 
   heap_init(&h, compare, free);
+  memset(&s, 0, sizeof (s));
+  heap_stats_attach(&h, &s);
 
   for (i = 0; i < n; i++) {
     assert((keys[i] = malloc(sizeof (*keys[i]))));
@@ -397,6 +545,14 @@ int main(int argc, char *argv[])
     printf("------------------------------------\n");
   }
 
+  for (i = 0; i < n; i += 2) {
+    free(heap_remove(&h, a[i]));
+    print_heap(&h, print_int);
+    printf("------------------------------------\n");
+  }
+
+  heap_stats_print(stdout, "test", &s, 1);
+
   free(keys);
 
   return 0;
@@ -5,16 +5,39 @@
 extern "C" {
 # endif
 
+# include <stdio.h>
 # include <stdint.h>
 
 struct heap_node;
 typedef struct heap_node heap_node_t;
 
+/* What a heap has been up to, for tuning.  Kept only for heaps with *
+ * stats attached; any number of heaps may share one block, so long *
+ * as they're all used by the same thread.  remove_mins includes the *
+ * removals heap_remove() makes, and cuts the cascading ones.  degree *
+ * counts the trees left in the root list by each consolidation.      */
+# define HEAP_MAX_DEGREE 64
+
+typedef struct heap_stats {
+  uint64_t inserts;
+  uint64_t remove_mins;
+  uint64_t decrease_keys;
+  uint64_t removes;
+  uint64_t consolidations;
+  uint64_t links;
+  uint64_t cuts;
+  uint64_t cascading_cuts;
+  uint32_t max_roots;
+  uint32_t max_size;
+  uint64_t degree[HEAP_MAX_DEGREE];
+} heap_stats_t;
+
 typedef struct heap {
   heap_node_t *min;
   uint32_t size;
   int32_t (*compare)(const void *key, const void *with);
   void (*datum_delete)(void *);
+  heap_stats_t *stats;
 } heap_t;
 
 void heap_init(heap_t *h,
@@ -27,6 +50,12 @@ void *heap_remove_min(heap_t *h);
 int heap_combine(heap_t *h, heap_t *h1, heap_t *h2);
 int heap_decrease_key(heap_t *h, heap_node_t *n, void *v);
 int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n);
+void *heap_remove(heap_t *h, heap_node_t *n);
+void heap_cache_release(void);
+void heap_stats_attach(heap_t *h, heap_stats_t *s);
+void heap_stats_merge(heap_stats_t *into, const heap_stats_t *from);
+void heap_stats_print(FILE *f, const char *name, const heap_stats_t *s,
+                      uint64_t per);
 
 # ifdef __cplusplus
 }
@@ -1,25 +1,279 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <ncurses.h>
 #include <cctype>
 #include <cstdlib>
 #include <climits>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
 
 #include "io.h"
 #include "character.h"
 #include "poke327.h"
+#include "route.h"
+#include "prof.h"
+
+/* Messages wait in a fixed ring of preformatted slots, so queueing one *
+ * never allocates.  The ring may be pushed from any thread while the   *
+ * UI thread drains it, without either side locking: a producer claims  *
+ * a slot by advancing io_ring_head and publishes it through the slot's *
+ * sequence number, after Vyukov's bounded queue.                       *
+ * When the ring is full the oldest message is dropped to make room,    *
+ * or the new one if there's still no room after that, and runs of     *
+ * identical messages are coalesced into one when shown.                */
+#define IO_MESSAGES 64 /* Must be a power of two */
 
 typedef struct io_message {
-  /* Will print " --more-- " at end of line when another message follows. *
-   * Leave 10 extra spaces for that.                                      */
-  char msg[71];
-  struct io_message *next;
+  /* Offset by the slot's index so that the zeroed ring starts out valid */
+  uint32_t seq;
+  char msg[IO_MESSAGE_LEN];
 } io_message_t;
 
-static io_message_t *io_head, *io_tail;
+static io_message_t io_ring[IO_MESSAGES];
+static uint32_t io_ring_head, io_ring_tail;
+/* Messages lost to a full ring, old or new */
+static uint32_t io_ring_dropped;
+
+/* Headless runs have no terminal.  Nothing is drawn and keystrokes come *
+ * from a script, or from a simple bot if there is none, until the turn  *
+ * budget or the script runs out.                                        */
+static int io_headless;
+static FILE *io_script;
+static uint32_t io_turns_left;
+static int io_bot_key = '6';
+
+/* Render backends.  io_display() and the prompts compose the screen in *
+ * io_next, and io_present() passes whatever differs from io_shown to   *
+ * the backend, a row span at a time.  The curses backend draws through *
+ * ncurses as always.  The ANSI backend builds the escape sequences for *
+ * the whole frame in one buffer and writes it with a single write().   *
+ * The memory backend keeps nothing but io_shown, for tests and         *
+ * headless runs.  Keystrokes always come through ncurses when there is *
+ * a terminal.                                                          */
+#define IO_ROWS 24
+#define IO_COLS 80
+
+typedef struct io_backend {
+  const char *name;
+  void (*clear)(void);
+  void (*draw)(int32_t y, int32_t x, const chtype *c, int32_t n);
+  void (*present)(void);
+} io_backend_t;
+
+static chtype io_next[IO_ROWS][IO_COLS], io_shown[IO_ROWS][IO_COLS];
+/* Rows of io_next written since the last io_present() */
+static uint32_t io_touched;
+/* NULL in headless runs that aren't rendering */
+static const io_backend_t *io_backend;
+static int io_out_fd = STDOUT_FILENO;
+static uint64_t io_frames, io_cells, io_start_writes, io_start_bytes;
+
+static void io_curses_clear(void)
+{
+  clear();
+}
 
-void io_init_terminal(void)
+static void io_curses_draw(int32_t y, int32_t x, const chtype *c, int32_t n)
+{
+  mvaddchnstr(y, x, c, n);
+}
+
+static void io_curses_present(void)
+{
+  refresh();
+}
+
+static const io_backend_t io_curses_backend = {
+  "curses", io_curses_clear, io_curses_draw, io_curses_present
+};
+
+/* Room for the most any one cell or cursor move can add */
+#define IO_ANSI_ROOM 32
+
+static char io_ansi_buf[1 << 15];
+static uint32_t io_ansi_len;
+static int io_ansi_pair;
+
+static void io_ansi_flush(void)
+{
+  uint32_t i;
+  ssize_t n;
+
+  for (i = 0; i < io_ansi_len; i += n) {
+    if ((n = write(io_out_fd, io_ansi_buf + i, io_ansi_len - i)) < 0) {
+      if (errno != EINTR) {
+        break;
+      }
+      n = 0;
+    }
+  }
+
+  io_ansi_len = 0;
+}
+
+static void io_ansi_clear(void)
+{
+  if (io_ansi_len + IO_ANSI_ROOM > sizeof (io_ansi_buf)) {
+    io_ansi_flush();
+  }
+  io_ansi_len += snprintf(io_ansi_buf + io_ansi_len,
+                          sizeof (io_ansi_buf) - io_ansi_len,
+                          "\033[37;40m\033[H\033[2J");
+  io_ansi_pair = 0;
+}
+
+/* Color pairs are set up so that pair n is color n on black, and pair *
+ * zero is white on black, as curses has it without default colors.    */
+static void io_ansi_draw(int32_t y, int32_t x, const chtype *c, int32_t n)
+{
+  int32_t i;
+  int p;
+
+  if (io_ansi_len + IO_ANSI_ROOM > sizeof (io_ansi_buf)) {
+    io_ansi_flush();
+  }
+  io_ansi_len += snprintf(io_ansi_buf + io_ansi_len,
+                          sizeof (io_ansi_buf) - io_ansi_len,
+                          "\033[%d;%dH", y + 1, x + 1);
+
+  for (i = 0; i < n; i++) {
+    if (io_ansi_len + IO_ANSI_ROOM > sizeof (io_ansi_buf)) {
+      io_ansi_flush();
+    }
+    if ((p = PAIR_NUMBER(c[i])) != io_ansi_pair) {
+      io_ansi_len += snprintf(io_ansi_buf + io_ansi_len,
+                              sizeof (io_ansi_buf) - io_ansi_len,
+                              "\033[3%d;40m", p ? p : COLOR_WHITE);
+      io_ansi_pair = p;
+    }
+    io_ansi_buf[io_ansi_len++] = c[i] & A_CHARTEXT;
+  }
+}
+
+static void io_ansi_present(void)
+{
+  if (io_ansi_len) {
+    io_ansi_flush();
+  }
+}
+
+static const io_backend_t io_ansi_backend = {
+  "ansi", io_ansi_clear, io_ansi_draw, io_ansi_present
+};
+
+static void io_memory_clear(void)
+{
+}
+
+static void io_memory_draw(int32_t y, int32_t x, const chtype *c, int32_t n)
+{
+}
+
+static void io_memory_present(void)
+{
+}
+
+static const io_backend_t io_memory_backend = {
+  "memory", io_memory_clear, io_memory_draw, io_memory_present
+};
+
+/* Sends the changed parts of the touched rows to the backend */
+static void io_present(void)
+{
+  int32_t y, lo, hi;
+
+  for (y = 0; y < IO_ROWS; y++) {
+    if (!(io_touched & (1U << y))) {
+      continue;
+    }
+    for (lo = 0; lo < IO_COLS && io_next[y][lo] == io_shown[y][lo]; lo++)
+      ;
+    for (hi = IO_COLS - 1; hi >= lo && io_next[y][hi] == io_shown[y][hi]; hi--)
+      ;
+    if (lo <= hi) {
+      io_backend->draw(y, lo, io_next[y] + lo, hi - lo + 1);
+      memcpy(io_shown[y] + lo, io_next[y] + lo,
+             (hi - lo + 1) * sizeof (**io_next));
+      io_cells += hi - lo + 1;
+    }
+  }
+
+  io_touched = 0;
+  io_backend->present();
+}
+
+/* printf() into io_next at (x, y), clipped to the screen */
+static void io_text(int32_t y, int32_t x, chtype attr, const char *format, ...)
+{
+  char s[IO_COLS + 1];
+  va_list ap;
+  int32_t i;
+
+  va_start(ap, format);
+  vsnprintf(s, sizeof (s), format, ap);
+  va_end(ap);
+
+  for (i = 0; s[i] && x + i < IO_COLS; i++) {
+    io_next[y][x + i] = (unsigned char) s[i] | attr;
+  }
+  io_touched |= 1U << y;
+}
+
+static void io_blank(int32_t y)
+{
+  int32_t x;
+
+  for (x = 0; x < IO_COLS; x++) {
+    io_next[y][x] = ' ';
+  }
+  io_touched |= 1U << y;
+}
+
+/* The trainer list and the fly prompt draw with ncurses directly.  Any *
+ * other backend has left ncurses with no idea what is on the screen,   *
+ * so give it the current frame and have it redraw everything on its   *
+ * next refresh.  Either way, io_shown is stale afterward, which the   *
+ * callers fix by asking for a full repaint.                           */
+static void io_curses_overlay(void)
+{
+  int32_t y;
+
+  if (io_backend == &io_curses_backend) {
+    return;
+  }
+
+  for (y = 0; y < IO_ROWS; y++) {
+    mvaddchnstr(y, 0, io_shown[y], IO_COLS);
+  }
+  clearok(curscr, TRUE);
+}
+
+/* Totals of write() calls and bytes written by this process so far */
+static void io_write_counts(uint64_t *writes, uint64_t *bytes)
+{
+  char line[64];
+  FILE *f;
+
+  *writes = *bytes = 0;
+  if ((f = fopen("/proc/self/io", "r"))) {
+    while (fgets(line, sizeof (line), f)) {
+      sscanf(line, "syscw: %" SCNu64, writes);
+      sscanf(line, "wchar: %" SCNu64, bytes);
+    }
+    fclose(f);
+  }
+}
+
+void io_init_headless(FILE *script, uint32_t turns)
+{
+  io_headless = 1;
+  io_script = script;
+  io_turns_left = turns;
+}
+
+static void io_init_curses(void)
 {
-  initscr();
   raw();
   noecho();
   curs_set(0);
@@ -34,233 +288,435 @@ void io_init_terminal(void)
   init_pair(COLOR_WHITE, COLOR_WHITE, COLOR_BLACK);
 }
 
-void io_reset_terminal(void)
+void io_init_terminal(void)
+{
+  initscr();
+  io_init_curses();
+  io_backend = &io_curses_backend;
+}
+
+/* Switches to another backend.  Headless runs draw into /dev/null and *
+ * report what it cost at the end; see io_render_report().            */
+void io_init_render(io_render_t r)
+{
+  FILE *out;
+
+  if (io_headless) {
+    io_out_fd = open("/dev/null", O_WRONLY);
+    if (r == io_render_curses) {
+      out = fdopen(io_out_fd, "w");
+      newterm(getenv("TERM") ? getenv("TERM") : "xterm",
+              out, fopen("/dev/null", "r"));
+      io_init_curses();
+    }
+  } else if (r != io_render_curses) {
+    /* ncurses still reads the keyboard.  Let it have its first, full *
+     * refresh now, so it doesn't do it over our frame later.         */
+    refresh();
+  }
+
+  switch (r) {
+  case io_render_curses:
+    io_backend = &io_curses_backend;
+    break;
+  case io_render_ansi:
+    io_backend = &io_ansi_backend;
+    break;
+  case io_render_memory:
+    io_backend = &io_memory_backend;
+    break;
+  }
+
+  fflush(stdout);
+  io_write_counts(&io_start_writes, &io_start_bytes);
+}
+
+void io_render_report(void)
+{
+  uint64_t writes, bytes;
+
+  io_write_counts(&writes, &bytes);
+  writes -= io_start_writes;
+  bytes -= io_start_bytes;
+
+  printf("%s: %llu frames, %.1f cells, %.1f bytes, %.2f writes per frame\n",
+         io_backend->name, (unsigned long long) io_frames,
+         (double) io_cells / (io_frames ? io_frames : 1),
+         (double) bytes / (io_frames ? io_frames : 1),
+         (double) writes / (io_frames ? io_frames : 1));
+}
+
+static uint32_t io_ring_seq(uint32_t i)
+{
+  return (__atomic_load_n(&io_ring[i & (IO_MESSAGES - 1)].seq,
+                          __ATOMIC_ACQUIRE) + (i & (IO_MESSAGES - 1)));
+}
+
+static void io_ring_publish(uint32_t i, uint32_t seq)
+{
+  __atomic_store_n(&io_ring[i & (IO_MESSAGES - 1)].seq,
+                   seq - (i & (IO_MESSAGES - 1)), __ATOMIC_RELEASE);
+}
+
+/* Takes the oldest message, copying it to msg unless msg is NULL. */
+static int io_ring_pop(char *msg)
 {
-  endwin();
+  uint32_t pos;
+  int32_t diff;
+
+  pos = __atomic_load_n(&io_ring_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    diff = (int32_t) (io_ring_seq(pos) - (pos + 1));
+    if (diff < 0) {
+      return 0;
+    }
+    if (!diff &&
+        __atomic_compare_exchange_n(&io_ring_tail, &pos, pos + 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (diff) {
+      pos = __atomic_load_n(&io_ring_tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (msg) {
+    memcpy(msg, io_ring[pos & (IO_MESSAGES - 1)].msg,
+           sizeof (io_ring[0].msg));
+  }
+  io_ring_publish(pos, pos + IO_MESSAGES);
+
+  return 1;
+}
 
-  while (io_head) {
-    io_tail = io_head;
-    io_head = io_head->next;
-    free(io_tail);
+/* Queues msg.  A full ring gives up its oldest message, but only once *
+ * per push: if it's full again when we look, because a reader hasn't   *
+ * finished with the slot at the tail or another writer got in first,  *
+ * msg is dropped instead of one message after another from the queue. */
+static void io_ring_push(const char *msg)
+{
+  uint32_t pos;
+  int32_t diff;
+  int popped;
+
+  pos = __atomic_load_n(&io_ring_head, __ATOMIC_RELAXED);
+  for (popped = 0; ; ) {
+    diff = (int32_t) (io_ring_seq(pos) - pos);
+    if (!diff &&
+        __atomic_compare_exchange_n(&io_ring_head, &pos, pos + 1, 1,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (diff < 0) {
+      if (popped) {
+        __atomic_fetch_add(&io_ring_dropped, 1, __ATOMIC_RELAXED);
+        return;
+      }
+      if (io_ring_pop(NULL)) {
+        __atomic_fetch_add(&io_ring_dropped, 1, __ATOMIC_RELAXED);
+      }
+      popped = 1;
+    }
+    if (diff) {
+      pos = __atomic_load_n(&io_ring_head, __ATOMIC_RELAXED);
+    }
   }
-  io_tail = NULL;
+
+  memcpy(io_ring[pos & (IO_MESSAGES - 1)].msg, msg, sizeof (io_ring[0].msg));
+  io_ring_publish(pos, pos + 1);
+}
+
+void io_reset_terminal(void)
+{
+  if (io_backend == &io_curses_backend || !io_headless) {
+    endwin();
+  }
+
+  while (io_ring_pop(NULL))
+    ;
+}
+
+int io_take_message(char *msg)
+{
+  return io_ring_pop(msg);
+}
+
+uint32_t io_dropped_messages(void)
+{
+  return __atomic_load_n(&io_ring_dropped, __ATOMIC_RELAXED);
 }
 
 void io_queue_message(const char *format, ...)
 {
-  io_message_t *tmp;
+  char msg[sizeof (io_ring[0].msg)];
   va_list ap;
 
-  if (!(tmp = (io_message_t *) malloc(sizeof (*tmp)))) {
-    perror("malloc");
-    exit(1);
+  if (io_headless) {
+    return;
   }
 
-  tmp->next = NULL;
-
   va_start(ap, format);
 
-  vsnprintf(tmp->msg, sizeof (tmp->msg), format, ap);
+  vsnprintf(msg, sizeof (msg), format, ap);
 
   va_end(ap);
 
-  if (!io_head) {
-    io_head = io_tail = tmp;
-  } else {
-    io_tail->next = tmp;
-    io_tail = tmp;
-  }
+  io_ring_push(msg);
 }
 
 static void io_print_message_queue(uint32_t y, uint32_t x)
 {
-  while (io_head) {
-    io_tail = io_head;
-    attron(COLOR_PAIR(COLOR_CYAN));
-    mvprintw(y, x, "%-80s", io_head->msg);
-    attroff(COLOR_PAIR(COLOR_CYAN));
-    io_head = io_head->next;
-    if (io_head) {
-      attron(COLOR_PAIR(COLOR_CYAN));
-      mvprintw(y, x + 70, "%10s", " --more-- ");
-      attroff(COLOR_PAIR(COLOR_CYAN));
-      refresh();
+  char msg[sizeof (io_ring[0].msg)], next[sizeof (msg)], line[sizeof (msg)];
+  uint32_t repeat;
+  int more, n;
+
+  if (!io_ring_pop(next)) {
+    return;
+  }
+
+  do {
+    memcpy(msg, next, sizeof (msg));
+    repeat = 1;
+    while ((more = io_ring_pop(next)) && !strcmp(msg, next)) {
+      repeat++;
+    }
+    if (repeat > 1) {
+      n = snprintf(NULL, 0, " (x%u)", repeat);
+      snprintf(line, sizeof (line), "%.*s (x%u)",
+               (int) (sizeof (line) - 1 - n), msg, repeat);
+    } else {
+      memcpy(line, msg, sizeof (line));
+    }
+    io_text(y, x, COLOR_PAIR(COLOR_CYAN), "%-80s", line);
+    if (more) {
+      io_text(y, x + 70, COLOR_PAIR(COLOR_CYAN), "%10s", " --more-- ");
+      io_present();
       getch();
     }
-    free(io_tail);
-  }
-  io_tail = NULL;
+  } while (more);
 }
 
 /**************************************************************************
- * Compares trainer distances from the PC according to the rival distance *
+ * Measures trainer distances from the PC according to the rival distance *
  * map.  This gives the approximate distance that the PC must travel to   *
  * get to the trainer (doesn't account for crossing buildings).  This is  *
  * not the distance from the NPC to the PC unless the NPC is a rival.     *
  *                                                                        *
  * Not a bug.                                                             *
  **************************************************************************/
-static int compare_trainer_distance(const void *v1, const void *v2)
+static inline uint32_t trainer_distance(char_id_t c)
 {
-  const character *const *c1 = (const character * const *) v1;
-  const character *const *c2 = (const character * const *) v2;
+  const int16_t *p = world.cur_map->npc.pos[c];
 
-  return (world.rival_dist[(*c1)->pos[dim_y]][(*c1)->pos[dim_x]] -
-          world.rival_dist[(*c2)->pos[dim_y]][(*c2)->pos[dim_x]]);
+  return world.rival_dist[p[dim_y]][p[dim_x]];
 }
 
-static character *io_nearest_visible_trainer()
+/* Every NPC on the map is a trainer and lives in the map's NPC store, *
+ * which step_npc() keeps up to date as they move, so that is all the  *
+ * index we need.  The nearest one is a single pass over it.  Ties go  *
+ * to whichever comes first reading the map top to bottom, left to     *
+ * right, as they always have.                                         */
+static char_id_t io_nearest_visible_trainer()
 {
-  character **c, *n;
-  uint32_t x, y, count;
+  npc_store_t *n = &world.cur_map->npc;
+  char_id_t c, best;
+
+  for (best = CHAR_NONE, c = NPC_FIRST; c < NPC_FIRST + n->count; c++) {
+    if (!best || trainer_distance(c) < trainer_distance(best) ||
+        (trainer_distance(c) == trainer_distance(best) &&
+         (n->pos[c][dim_y] < n->pos[best][dim_y] ||
+          (n->pos[c][dim_y] == n->pos[best][dim_y] &&
+           n->pos[c][dim_x] < n->pos[best][dim_x])))) {
+      best = c;
+    }
+  }
 
-  c = (character **) malloc(world.cur_map->num_trainers * sizeof (*c));
+  return best;
+}
 
-  /* Get a linear list of trainers */
-  for (count = 0, y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (world.cur_map->cmap[y][x] && world.cur_map->cmap[y][x] !=
-          &world.pc) {
-        c[count++] = world.cur_map->cmap[y][x];
-      }
-    }
+/* Byte b of the sort key for c: x, then y, then three of distance */
+static inline uint8_t trainer_key(char_id_t c, uint32_t b)
+{
+  const int16_t *p = world.cur_map->npc.pos[c];
+  uint32_t d;
+
+  if (b < 2) {
+    return p[b ? dim_y : dim_x];
   }
 
-  /* Sort it by distance from PC */
-  qsort(c, count, sizeof (*c), compare_trainer_distance);
+  d = trainer_distance(c);
 
-  n = c[0];
+  return ((d > 0xffffff ? 0xffffff : d) >> ((b - 2) * 8)) & 0xff;
+}
+
+/* Fills c with the map's trainers, nearest first, and returns how many *
+ * there are.  A radix sort, least significant byte first, which is    *
+ * linear in the number of trainers and needs nothing from the heap.   *
+ * Anything farther than 2^24 (that is, unreachable) sorts last.       */
+static uint32_t io_trainers_by_distance(char_id_t *c)
+{
+  npc_store_t *n = &world.cur_map->npc;
+  char_id_t tmp[NPC_MAX], *from, *to, *t;
+  uint32_t count[256], i, b, sum, k;
+
+  for (i = 0; i < n->count; i++) {
+    c[i] = NPC_FIRST + i;
+  }
+
+  for (from = c, to = tmp, b = 0; b < 5; b++) {
+    memset(count, 0, sizeof (count));
+    for (i = 0; i < n->count; i++) {
+      count[trainer_key(from[i], b)]++;
+    }
+    for (sum = i = 0; i < 256; i++) {
+      k = count[i];
+      count[i] = sum;
+      sum += k;
+    }
+    for (i = 0; i < n->count; i++) {
+      to[count[trainer_key(from[i], b)]++] = from[i];
+    }
+    t = from;
+    from = to;
+    to = t;
+  }
 
-  free(c);
+  /* An odd number of passes leaves the result in tmp */
+  memcpy(c, from, n->count * sizeof (*c));
 
-  return n;
+  return n->count;
 }
 
+/* Each terrain's glyph and color, ready to go on the screen.  Indexed *
+ * by the four-bit packed terrain, so anything past the real types is  *
+ * an error.  Characters are drawn uncolored, so their symbol already  *
+ * is their chtype.                                                    */
+static constexpr chtype io_ter_glyph[16] = {
+  BOULDER_SYMBOL        | COLOR_PAIR(COLOR_MAGENTA),
+  TREE_SYMBOL           | COLOR_PAIR(COLOR_GREEN),
+  PATH_SYMBOL           | COLOR_PAIR(COLOR_YELLOW),
+  POKEMART_SYMBOL       | COLOR_PAIR(COLOR_BLUE),
+  POKEMON_CENTER_SYMBOL | COLOR_PAIR(COLOR_RED),
+  TALL_GRASS_SYMBOL     | COLOR_PAIR(COLOR_GREEN),
+  SHORT_GRASS_SYMBOL    | COLOR_PAIR(COLOR_GREEN),
+  MOUNTAIN_SYMBOL       | COLOR_PAIR(COLOR_MAGENTA),
+  FOREST_SYMBOL         | COLOR_PAIR(COLOR_GREEN),
+  WATER_SYMBOL          | COLOR_PAIR(COLOR_CYAN),
+  GATE_SYMBOL           | COLOR_PAIR(COLOR_YELLOW),
+  BAILEY_SYMBOL         | COLOR_PAIR(COLOR_YELLOW),
+  ERROR_SYMBOL          | COLOR_PAIR(COLOR_CYAN),
+  ERROR_SYMBOL          | COLOR_PAIR(COLOR_CYAN),
+  ERROR_SYMBOL          | COLOR_PAIR(COLOR_CYAN),
+  ERROR_SYMBOL          | COLOR_PAIR(COLOR_CYAN),
+};
+
+static_assert(num_terrain_types <= 16, "Terrain must fit in a nibble");
+
+/* The map whose cells are in io_next.  Only cells it has marked dirty *
+ * since are looked at again, and io_present() only passes on those    *
+ * that come out different, so a turn in which three trainers take a   *
+ * step costs the terminal a handful of characters instead of the      *
+ * whole screen.  Overlays that draw over the map ask for the whole    *
+ * thing to be drawn again when they go away.                          */
+static map *io_frame_map;
+static int io_repaint;
+
+/* A run or trip in progress moves the PC a step a turn without a key  *
+ * press, and nothing is drawn until it stops.  Runs go one way, a     *
+ * numeric direction key; trips follow one of the map's facility       *
+ * distances downhill.                                                 */
+static struct {
+  int dir;
+  const uint16_t (*trip)[MAP_X];
+  uint32_t steps;
+  map *m;
+} io_run;
+
 void io_display()
 {
-  uint32_t y, x;
-  character *c;
+  int32_t y, x, lo, hi;
+  char_id_t c;
+  int16_t *pos;
+  map *m = world.cur_map;
+
+  /* A headless run that's out of turns only has the quit left to read */
+  if (!io_backend || io_run.steps || (io_headless && !io_turns_left)) {
+    return;
+  }
+
+  PROF_SCOPE(prof_io_display);
+
+  if (io_repaint || m != io_frame_map) {
+    io_backend->clear();
+    memset(io_shown, 0, sizeof (io_shown));
+    for (y = 0; y < MAP_Y; y++) {
+      m->dirty[y] = row_span(0, MAP_X - 1);
+    }
+    io_frame_map = m;
+    io_repaint = 0;
+  }
+
+  /* Whatever the last turn left on the message and status lines */
+  io_blank(0);
+  io_blank(22);
+  io_blank(23);
 
-  clear();
   for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      if (world.cur_map->cmap[y][x]) {
-        mvaddch(y + 1, x, world.cur_map->cmap[y][x]->symbol);
-      } else {
-        switch (world.cur_map->map[y][x]) {
-        case ter_boulder:
-          attron(COLOR_PAIR(COLOR_MAGENTA));
-          mvaddch(y + 1, x, BOULDER_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_MAGENTA));
-          break;
-        case ter_mountain:
-          attron(COLOR_PAIR(COLOR_MAGENTA));
-          mvaddch(y + 1, x, MOUNTAIN_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_MAGENTA));
-          break;
-        case ter_tree:
-          attron(COLOR_PAIR(COLOR_GREEN));
-          mvaddch(y + 1, x, TREE_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_GREEN));
-          break;
-        case ter_forest:
-          attron(COLOR_PAIR(COLOR_GREEN));
-          mvaddch(y + 1, x, FOREST_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_GREEN));
-          break;
-        case ter_path:
-          attron(COLOR_PAIR(COLOR_YELLOW));
-          mvaddch(y + 1, x, PATH_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_YELLOW));
-          break;
-        case ter_gate:
-          attron(COLOR_PAIR(COLOR_YELLOW));
-          mvaddch(y + 1, x, GATE_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_YELLOW));
-          break;
-        case ter_bailey:
-          attron(COLOR_PAIR(COLOR_YELLOW));
-          mvaddch(y + 1, x, BAILEY_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_YELLOW));
-          break;
-        case ter_mart:
-          attron(COLOR_PAIR(COLOR_BLUE));
-          mvaddch(y + 1, x, POKEMART_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_BLUE));
-          break;
-        case ter_center:
-          attron(COLOR_PAIR(COLOR_RED));
-          mvaddch(y + 1, x, POKEMON_CENTER_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_RED));
-          break;
-        case ter_grass:
-          attron(COLOR_PAIR(COLOR_GREEN));
-          mvaddch(y + 1, x, TALL_GRASS_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_GREEN));
-          break;
-        case ter_clearing:
-          attron(COLOR_PAIR(COLOR_GREEN));
-          mvaddch(y + 1, x, SHORT_GRASS_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_GREEN));
-          break;
-        case ter_water:
-          attron(COLOR_PAIR(COLOR_CYAN));
-          mvaddch(y + 1, x, WATER_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_CYAN));
-          break;
-        default:
-          attron(COLOR_PAIR(COLOR_CYAN));
-          mvaddch(y + 1, x, ERROR_SYMBOL);
-          attroff(COLOR_PAIR(COLOR_CYAN)); 
-       }
-      }
+    if (!m->dirty[y]) {
+      continue;
     }
+
+    lo = row_ctz(m->dirty[y]);
+    hi = row_top(m->dirty[y]);
+    m->dirty[y] = 0;
+
+    for (x = lo; x <= hi; x++) {
+      io_next[y + 1][x] = (m->cmap[y][x] ?
+                           (chtype) char_symbol(m, m->cmap[y][x]) :
+                           io_ter_glyph[ter_at(m, x, y)]);
+    }
+    io_touched |= 1U << (y + 1);
   }
 
-  mvprintw(23, 1, "PC position is (%2d,%2d) on map %d%cx%d%c.",
-           world.pc.pos[dim_x],
-           world.pc.pos[dim_y],
-           abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_x] - (WORLD_SIZE / 2) >= 0 ? 'E' : 'W',
-           abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_y] - (WORLD_SIZE / 2) <= 0 ? 'N' : 'S');
-  mvprintw(22, 1, "%d known %s.", world.cur_map->num_trainers,
-           world.cur_map->num_trainers > 1 ? "trainers" : "trainer");
-  mvprintw(22, 30, "Nearest visible trainer: ");
+  io_text(23, 1, 0, "PC position is (%2d,%2d) on map %d%cx%d%c.",
+          world.pc.pos[dim_x],
+          world.pc.pos[dim_y],
+          abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)),
+          world.cur_idx[dim_x] - (WORLD_SIZE / 2) >= 0 ? 'E' : 'W',
+          abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)),
+          world.cur_idx[dim_y] - (WORLD_SIZE / 2) <= 0 ? 'N' : 'S');
+  io_text(22, 1, 0, "%d known %s.", world.cur_map->num_trainers,
+          world.cur_map->num_trainers > 1 ? "trainers" : "trainer");
+  io_text(22, 30, 0, "Nearest visible trainer: ");
   if ((c = io_nearest_visible_trainer())) {
-    attron(COLOR_PAIR(COLOR_RED));
-    mvprintw(22, 55, "%c at vector %d%cx%d%c.",
-             c->symbol,
-             abs(c->pos[dim_y] - world.pc.pos[dim_y]),
-             ((c->pos[dim_y] - world.pc.pos[dim_y]) <= 0 ?
-              'N' : 'S'),
-             abs(c->pos[dim_x] - world.pc.pos[dim_x]),
-             ((c->pos[dim_x] - world.pc.pos[dim_x]) <= 0 ?
-              'W' : 'E'));
-    attroff(COLOR_PAIR(COLOR_RED));
+    pos = world.cur_map->npc.pos[c];
+    io_text(22, 55, COLOR_PAIR(COLOR_RED), "%c at vector %d%cx%d%c.",
+            world.cur_map->npc.symbol[c],
+            abs(pos[dim_y] - world.pc.pos[dim_y]),
+            ((pos[dim_y] - world.pc.pos[dim_y]) <= 0 ?
+             'N' : 'S'),
+            abs(pos[dim_x] - world.pc.pos[dim_x]),
+            ((pos[dim_x] - world.pc.pos[dim_x]) <= 0 ?
+             'W' : 'E'));
   } else {
-    attron(COLOR_PAIR(COLOR_BLUE));
-    mvprintw(22, 55, "NONE.");
-    attroff(COLOR_PAIR(COLOR_BLUE));
+    io_text(22, 55, COLOR_PAIR(COLOR_BLUE), "NONE.");
   }
 
   io_print_message_queue(0, 0);
 
-  refresh();
+  io_present();
+  io_frames++;
 }
 
 uint32_t io_teleport_pc(pair_t dest)
 {
   /* Just for fun. And debugging.  Mostly debugging. */
+  if (teleport_pos(world.cur_map, dest)) {
+    dest[dim_x] = world.pc.pos[dim_x];
+    dest[dim_y] = world.pc.pos[dim_y];
 
-  do {
-    dest[dim_x] = rand_range(1, MAP_X - 2);
-    dest[dim_y] = rand_range(1, MAP_Y - 2);
-  } while (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]                  ||
-           move_cost[char_pc][world.cur_map->map[dest[dim_y]]
-                                                [dest[dim_x]]] ==
-             DIJKSTRA_PATH_MAX                                            ||
-           world.rival_dist[dest[dim_y]][dest[dim_x]] < 0);
+    return 1;
+  }
 
   return 0;
 }
@@ -294,12 +750,11 @@ static void io_scroll_trainer_list(char (*s)[40], uint32_t count)
   }
 }
 
-static void io_list_trainers_display(npc **c, uint32_t count)
+static void io_list_trainers_display(char_id_t *c, uint32_t count)
 {
+  npc_store_t *n = &world.cur_map->npc;
   uint32_t i;
-  char (*s)[40]; /* pointer to array of 40 char */
-
-  s = (char (*)[40]) malloc(count * sizeof (*s));
+  static char s[NPC_MAX][40];
 
   mvprintw(3, 19, " %-40s ", "");
   /* Borrow the first element of our array for this string: */
@@ -309,13 +764,13 @@ static void io_list_trainers_display(npc **c, uint32_t count)
 
   for (i = 0; i < count; i++) {
     snprintf(s[i], 40, "%16s %c: %2d %s by %2d %s",
-             char_type_name[c[i]->ctype],
-             c[i]->symbol,
-             abs(c[i]->pos[dim_y] - world.pc.pos[dim_y]),
-             ((c[i]->pos[dim_y] - world.pc.pos[dim_y]) <= 0 ?
+             char_type_name[n->ctype[c[i]]],
+             n->symbol[c[i]],
+             abs(n->pos[c[i]][dim_y] - world.pc.pos[dim_y]),
+             ((n->pos[c[i]][dim_y] - world.pc.pos[dim_y]) <= 0 ?
               "North" : "South"),
-             abs(c[i]->pos[dim_x] - world.pc.pos[dim_x]),
-             ((c[i]->pos[dim_x] - world.pc.pos[dim_x]) <= 0 ?
+             abs(n->pos[c[i]][dim_x] - world.pc.pos[dim_x]),
+             ((n->pos[c[i]][dim_x] - world.pc.pos[dim_x]) <= 0 ?
               "West" : "East"));
     if (count <= 13) {
       /* Handle the non-scrolling case right here. *
@@ -335,33 +790,20 @@ static void io_list_trainers_display(npc **c, uint32_t count)
              "Arrows to scroll, escape to continue.");
     io_scroll_trainer_list(s, count);
   }
-
-  free(s);
 }
 
 static void io_list_trainers()
 {
-  npc **c;
-  uint32_t x, y, count;
-
-  c = (npc **) malloc(world.cur_map->num_trainers * sizeof (*c));
+  char_id_t c[NPC_MAX];
+  uint32_t count;
 
-  /* Get a linear list of trainers */
-  for (count = 0, y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (world.cur_map->cmap[y][x] && world.cur_map->cmap[y][x] !=
-          &world.pc) {
-        c[count++] = dynamic_cast<npc *> (world.cur_map->cmap[y][x]);
-      }
-    }
-  }
-
-  /* Sort it by distance from PC */
-  qsort(c, count, sizeof (*c), compare_trainer_distance);
+  /* Get them sorted by distance from PC */
+  count = io_trainers_by_distance(c);
 
   /* Display it */
+  io_curses_overlay();
   io_list_trainers_display(c, count);
-  free(c);
+  io_repaint = 1;
 
   /* And redraw the map */
   io_display();
@@ -369,35 +811,48 @@ static void io_list_trainers()
 
 void io_pokemart()
 {
-  mvprintw(0, 0, "Welcome to the Pokemart.  Could I interest you in some Pokeballs?");
-  refresh();
+  if (io_headless) {
+    return;
+  }
+
+  io_text(0, 0, 0, "Welcome to the Pokemart.  Could I interest you in some Pokeballs?");
+  io_present();
   getch();
 }
 
 void io_pokemon_center()
 {
-  mvprintw(0, 0, "Welcome to the Pokemon Center.  How can Nurse Joy assist you?");
-  refresh();
+  if (io_headless) {
+    return;
+  }
+
+  io_text(0, 0, 0, "Welcome to the Pokemon Center.  How can Nurse Joy assist you?");
+  io_present();
   getch();
 }
 
-void io_battle(character *aggressor, character *defender)
+void io_battle(map *m, char_id_t n)
 {
-  npc *n = (npc *) ((aggressor == &world.pc) ? defender : aggressor);
-
-  io_display();
-  mvprintw(0, 0, "Aww, how'd you get so strong?  You and your pokemon must share a special bond!");
-  refresh();
-  getch();
+  io_run.steps = 0;
+
+  if (!io_headless) {
+    io_display();
+    io_text(0, 0, 0, "Aww, how'd you get so strong?  "
+            "You and your pokemon must share a special bond!");
+    io_present();
+    getch();
+  }
 
-  n->defeated = 1;
-  if (n->ctype == char_hiker || n->ctype == char_rival) {
-    n->mtype = move_wander;
+  m->npc.defeated[n] = 1;
+  if (m->npc.ctype[n] == char_hiker || m->npc.ctype[n] == char_rival) {
+    m->npc.mtype[n] = move_wander;
   }
 }
 
 uint32_t move_pc_dir(uint32_t input, pair_t dest)
 {
+  char_id_t n;
+
   dest[dim_y] = world.pc.pos[dim_y];
   dest[dim_x] = world.pc.pos[dim_x];
 
@@ -433,37 +888,35 @@ uint32_t move_pc_dir(uint32_t input, pair_t dest)
     dest[dim_x]++;
     break;
   case '>':
-    if (world.cur_map->map[world.pc.pos[dim_y]][world.pc.pos[dim_x]] ==
-        ter_mart) {
+    if (ter_is(world.cur_map, world.pc.pos[dim_x], world.pc.pos[dim_y],
+               ter_mart)) {
       io_pokemart();
     }
-    if (world.cur_map->map[world.pc.pos[dim_y]][world.pc.pos[dim_x]] ==
-        ter_center) {
+    if (ter_is(world.cur_map, world.pc.pos[dim_x], world.pc.pos[dim_y],
+               ter_center)) {
       io_pokemon_center();
     }
     break;
   }
 
-  if (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]) {
-    if (dynamic_cast<npc *> (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]) &&
-        ((npc *) world.cur_map->cmap[dest[dim_y]][dest[dim_x]])->defeated) {
+  if ((n = world.cur_map->cmap[dest[dim_y]][dest[dim_x]])) {
+    if (is_npc(n) && world.cur_map->npc.defeated[n]) {
       // Some kind of greeting here would be nice
       return 1;
-    } else if ((dynamic_cast<npc *>
-                (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]))) {
-      io_battle(&world.pc, world.cur_map->cmap[dest[dim_y]][dest[dim_x]]);
+    } else if (is_npc(n)) {
+      io_battle(world.cur_map, n);
       // Not actually moving, so set dest back to PC position
       dest[dim_x] = world.pc.pos[dim_x];
       dest[dim_y] = world.pc.pos[dim_y];
     }
   }
   
-  if (move_cost[char_pc][world.cur_map->map[dest[dim_y]][dest[dim_x]]] ==
+  if (move_cost[char_pc][ter_at(world.cur_map, dest[dim_x], dest[dim_y])] ==
       DIJKSTRA_PATH_MAX) {
     return 1;
   }
 
-  if (world.cur_map->map[dest[dim_y]][dest[dim_x]] == ter_gate &&
+  if (ter_is(world.cur_map, dest[dim_x], dest[dim_y], ter_gate) &&
       dest[dim_y] != world.pc.pos[dim_y]                       &&
       dest[dim_x] != world.pc.pos[dim_x]) {
     return 1;
@@ -472,32 +925,52 @@ uint32_t move_pc_dir(uint32_t input, pair_t dest)
   return 0;
 }
 
-void io_teleport_world(pair_t dest)
+/* Asks for a map's coordinates, each in [-200, 200], for flying or *
+ * finding the way.                                                 */
+static void io_world_coords(int *x, int *y)
 {
   /* mvscanw documentation is unclear about return values.  I believe *
    * that the return value works the same way as scanf, but instead   *
    * of counting on that, we'll initialize x and y to out of bounds   *
    * values and accept their updates only if in range.                */
-  int x = INT_MAX, y = INT_MAX;
-  
-  world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = NULL;
+  *x = *y = INT_MAX;
+
+  if (io_headless) {
+    /* Scripts give the coordinates after the key; the bot picks any */
+    if (!io_script || fscanf(io_script, "%d %d", x, y) != 2 ||
+        *x < -200 || *x > 200 || *y < -200 || *y > 200) {
+      *x = rand_range(-200, 200);
+      *y = rand_range(-200, 200);
+    }
+  } else {
+    io_curses_overlay();
+    echo();
+    curs_set(1);
+    do {
+      mvprintw(0, 0, "Enter x [-200, 200]:           ");
+      refresh();
+      mvscanw(0, 21, "%d", x);
+    } while (*x < -200 || *x > 200);
+    do {
+      mvprintw(0, 0, "Enter y [-200, 200]:          ");
+      refresh();
+      mvscanw(0, 21, "%d", y);
+    } while (*y < -200 || *y > 200);
 
-  echo();
-  curs_set(1);
-  do {
-    mvprintw(0, 0, "Enter x [-200, 200]:           ");
-    refresh();
-    mvscanw(0, 21, "%d", &x);
-  } while (x < -200 || x > 200);
-  do {
-    mvprintw(0, 0, "Enter y [-200, 200]:          ");
     refresh();
-    mvscanw(0, 21, "%d", &y);
-  } while (y < -200 || y > 200);
+    noecho();
+    curs_set(0);
+    io_repaint = 1;
+  }
+}
 
-  refresh();
-  noecho();
-  curs_set(0);
+void io_teleport_world(pair_t dest)
+{
+  int x, y;
+  
+  cmap_set(world.cur_map, world.pc.pos[dim_x], world.pc.pos[dim_y], CHAR_NONE);
+
+  io_world_coords(&x, &y);
 
   x += 200;
   y += 200;
@@ -507,6 +980,194 @@ void io_teleport_world(pair_t dest)
 
   new_map(1);
   io_teleport_pc(dest);
+  world.map_changes++;
+}
+
+/* Tells the player the way to walk to another map, as the gates to *
+ * leave each map by: "3e 2n" is east three times, then north twice. */
+static void io_find_route(void)
+{
+  static const char side_name[num_gate_sides] = { 'n', 'e', 's', 'w' };
+  char gates[sizeof (io_ring[0].msg)];
+  uint32_t i, n, run;
+  route_t r;
+  pair_t to;
+  int x, y;
+
+  io_world_coords(&x, &y);
+  to[dim_x] = x + 200;
+  to[dim_y] = y + 200;
+
+  if (world_route(to, &r)) {
+    io_queue_message("There's no walking route to %d%cx%d%c.",
+                     abs(x), x >= 0 ? 'E' : 'W', abs(y), y <= 0 ? 'N' : 'S');
+  } else if (!r.len) {
+    io_queue_message("You're already there.");
+  } else {
+    for (n = 0, i = 0; i < r.len && n < sizeof (gates); i += run) {
+      for (run = 1; i + run < r.len && r.side[i + run] == r.side[i]; run++)
+        ;
+      n += snprintf(gates + n, sizeof (gates) - n, " %u%c",
+                    run, side_name[r.side[i]]);
+    }
+    io_queue_message("%d%cx%d%c is %u maps away, %s%d turns on foot.",
+                     abs(x), x >= 0 ? 'E' : 'W', abs(y), y <= 0 ? 'N' : 'S',
+                     r.len, r.exact ? "" : "about ", r.cost);
+    io_queue_message("Gates:%s", gates);
+    route_delete(&r);
+  }
+
+  io_display();
+}
+
+/* The bot walks in a straight line, which is what gets it from map to *
+ * map, turning now and then and whenever it's blocked.  Every so      *
+ * often it flies somewhere.                                           */
+static int io_bot_getch(int blocked)
+{
+  static const char keys[] = "12346789";
+
+  if (blocked || !(rand() % 32)) {
+    io_bot_key = keys[rand() % (sizeof (keys) - 1)];
+    /* Boxed in by defeated trainers, maybe; wait them out */
+    if (blocked && !(rand() % 8)) {
+      return '.';
+    }
+  }
+
+  return (rand() % 1000) ? io_bot_key : 'f';
+}
+
+/* Next keystroke, from the keyboard or, when headless, from the script *
+ * or bot.  blocked is set when the previous key didn't use the turn.   *
+ * Quits once the script or the turn budget is used up.                 */
+static int io_getch(int blocked)
+{
+  int key;
+
+  if (!io_headless) {
+    return getch();
+  }
+
+  if (!io_turns_left) {
+    return 'Q';
+  }
+
+  if (!io_script) {
+    key = io_bot_getch(blocked);
+  } else {
+    /* Whitespace separates things for the humans writing scripts */
+    while ((key = fgetc(io_script)) != EOF && isspace(key))
+      ;
+    if (key == EOF) {
+      return 'Q';
+    }
+  }
+
+  return key;
+}
+
+/* Runs and trips stop for a trainer this close who hasn't been beaten */
+#define IO_RUN_ALERT 2
+
+static int io_trainer_near(void)
+{
+  map *m = world.cur_map;
+  int16_t x, y;
+  char_id_t c;
+
+  for (y = world.pc.pos[dim_y] - IO_RUN_ALERT;
+       y <= world.pc.pos[dim_y] + IO_RUN_ALERT; y++) {
+    for (x = world.pc.pos[dim_x] - IO_RUN_ALERT;
+         x <= world.pc.pos[dim_x] + IO_RUN_ALERT; x++) {
+      if (x >= 0 && x < MAP_X && y >= 0 && y < MAP_Y &&
+          is_npc(c = m->cmap[y][x]) && !m->npc.defeated[c]) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Starts a trip to the nearest facility f */
+static void io_travel(facility_t f, const char *what)
+{
+  if (facility_dist(world.cur_map, f, world.pc.pos[dim_x],
+                    world.pc.pos[dim_y]) == DIJKSTRA_PATH_MAX) {
+    io_queue_message("There's no way to a %s from here.", what);
+    io_display();
+    return;
+  }
+
+  io_run.trip = world.cur_map->facility[f];
+  io_run.dir = 0;
+  io_run.steps = 1;
+  io_run.m = world.cur_map;
+}
+
+/* Shows where the run or trip left the PC */
+static void io_run_stop(void)
+{
+  io_run.steps = 0;
+  io_display();
+}
+
+static void io_run_dir(int dir)
+{
+  io_run.trip = NULL;
+  io_run.dir = dir;
+  io_run.steps = 1;
+  io_run.m = world.cur_map;
+}
+
+/* The next step of the run or trip in progress as a direction key, or *
+ * 0 if it's over: the PC has arrived somewhere worth stopping for, or  *
+ * changed maps, or a trainer is close.  The first step is always taken. */
+static int io_run_next(void)
+{
+  map *m = world.cur_map;
+  int16_t *p = world.pc.pos;
+  int32_t i, best, d, x, y;
+
+  if (!io_run.steps) {
+    return 0;
+  }
+
+  if (io_run.steps > 1 &&
+      (m != io_run.m || io_trainer_near() ||
+       (io_headless && !io_turns_left) ||
+       (!io_run.trip && ter_in(m, p[dim_x], p[dim_y],
+                               ter_mask(ter_mart) | ter_mask(ter_center))))) {
+    io_run_stop();
+    return 0;
+  }
+  io_run.steps++;
+
+  if (!io_run.trip) {
+    return io_run.dir;
+  }
+
+  /* Downhill, the way pathfind()'s distances are followed.  Gates on *
+   * the border may only be entered straight on.                      */
+  for (best = -1, d = io_run.trip[p[dim_y]][p[dim_x]], i = 0; d && i < 8; i++) {
+    x = p[dim_x] + all_dirs[i][dim_x];
+    y = p[dim_y] + all_dirs[i][dim_y];
+    if (io_run.trip[y][x] != FACILITY_FAR &&
+        io_run.trip[y][x] + move_cost[char_pc][ter_at(m, x, y)] <= d &&
+        !(ter_is(m, x, y, ter_gate) && x != p[dim_x] && y != p[dim_y])) {
+      best = i;
+      d = io_run.trip[y][x] + move_cost[char_pc][ter_at(m, x, y)];
+    }
+  }
+
+  if (best < 0) {
+    io_run_stop();
+    return 0;
+  }
+
+  /* Back to a numeric key: 7 8 9 above, 4 6 beside, 1 2 3 below */
+  return ('5' + all_dirs[best][dim_x] - 3 * all_dirs[best][dim_y]);
 }
 
 void io_handle_input(pair_t dest)
@@ -514,8 +1175,14 @@ void io_handle_input(pair_t dest)
   uint32_t turn_not_consumed;
   int key;
 
+  turn_not_consumed = 0;
+
   do {
-    switch (key = getch()) {
+    if (!(key = io_run_next())) {
+      key = io_getch(turn_not_consumed);
+    }
+
+    switch (key) {
     case '7':
     case 'y':
     case KEY_HOME:
@@ -567,6 +1234,26 @@ void io_handle_input(pair_t dest)
     case '>':
       turn_not_consumed = move_pc_dir('>', dest);
       break;
+    case 'Y':
+    case 'K':
+    case 'U':
+    case 'L':
+    case 'N':
+    case 'J':
+    case 'B':
+    case 'H':
+      /* Run until something turns up; the same keys as above, shifted */
+      io_run_dir("78963214"[strchr("YKULNJBH", key) - "YKULNJBH"]);
+      turn_not_consumed = 1;
+      break;
+    case 'M':
+      io_travel(fac_mart, "Pokemart");
+      turn_not_consumed = 1;
+      break;
+    case 'C':
+      io_travel(fac_center, "Pokemon Center");
+      turn_not_consumed = 1;
+      break;
     case 'Q':
       dest[dim_y] = world.pc.pos[dim_y];
       dest[dim_x] = world.pc.pos[dim_x];
@@ -575,7 +1262,9 @@ void io_handle_input(pair_t dest)
       break;
       break;
     case 't':
-      io_list_trainers();
+      if (!io_headless) {
+        io_list_trainers();
+      }
       turn_not_consumed = 1;
       break;
     case 'p':
@@ -583,6 +1272,11 @@ void io_handle_input(pair_t dest)
       io_teleport_pc(dest);
       turn_not_consumed = 0;
       break;
+    case 'w':
+      /* Find the walking route to any map in the world.             */
+      io_find_route();
+      turn_not_consumed = 1;
+      break;
     case 'f':
       /* Fly to any map in the world.                                */
       io_teleport_world(dest);
@@ -623,9 +1317,21 @@ void io_handle_input(pair_t dest)
        * octal, thus allowing us to do reverse lookups.  If a key has a *
        * name defined in the header, you can use the name here, else    *
        * you can directly use the octal value.                          */
-      mvprintw(0, 0, "Unbound key: %#o ", key);
+      if (!io_headless) {
+        io_text(0, 0, 0, "Unbound key: %#o ", key);
+      }
       turn_not_consumed = 1;
     }
-    refresh();
+    /* A run ends where it's blocked */
+    if (turn_not_consumed && io_run.steps > 1) {
+      io_run_stop();
+    }
+    if (!io_headless) {
+      io_present();
+    }
   } while (turn_not_consumed);
+
+  if (io_headless && io_turns_left) {
+    io_turns_left--;
+  }
 }
@@ -1,14 +1,38 @@
 #ifndef IO_H
 # define IO_H
 
-class character;
+# include <cstdio>
+# include <cstdint>
+
+class map;
 typedef int16_t pair_t[2];
+typedef uint16_t char_id_t;
+
+/* Will print " --more-- " at end of line when another message follows. *
+ * Leave 10 extra spaces for that.                                      */
+# define IO_MESSAGE_LEN 71
+
+typedef enum io_render {
+  io_render_curses,
+  io_render_ansi,
+  io_render_memory
+} io_render_t;
 
 void io_init_terminal(void);
+void io_init_headless(FILE *script, uint32_t turns);
+void io_init_render(io_render_t r);
+void io_render_report(void);
 void io_reset_terminal(void);
 void io_display(void);
 void io_handle_input(pair_t dest);
 void io_queue_message(const char *format, ...);
-void io_battle(character *aggressor, character *defender);
+/* Messages are cut to IO_MESSAGE_LEN - 1 characters.  Rather than shown *
+ * by io_display(), they may be taken one at a time, oldest first, into *
+ * a buffer of IO_MESSAGE_LEN; zero if there are none.  Safe from any   *
+ * thread, as is queueing them.  io_dropped_messages() counts those a  *
+ * full queue has lost.                                                 */
+int io_take_message(char *msg);
+uint32_t io_dropped_messages(void);
+void io_battle(map *m, char_id_t n);
 
 #endif
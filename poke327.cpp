@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <climits>
 #include <sys/time.h>
+#include <ctime>
 #include <cassert>
 #include <unistd.h>
 
@@ -13,12 +14,33 @@
 #include "poke327.h"
 #include "character.h"
 #include "io.h"
+#include "pool.h"
+#include "prof.h"
 
 typedef struct queue_node {
-  int x, y;
-  struct queue_node *next;
+  int16_t x, y;
 } queue_node_t;
 
+/* Everything that is only needed while a map is being generated.  None of *
+ * this survives new_map(), so rather than carrying it around in every map *
+ * we keep one per thread and reuse it.  Every cell is in the frontier at  *
+ * most once at any given time, so a ring the size of the map suffices.    */
+typedef struct gen_ctx {
+  terrain_type_t map[MAP_Y][MAP_X];
+  uint8_t height[MAP_Y][MAP_X];
+  uint8_t diffused[MAP_Y][MAP_X];
+  path_t path[MAP_Y][MAP_X];
+  queue_node_t frontier[MAP_Y * MAP_X];
+  uint32_t head, count;
+} gen_ctx_t;
+
+static thread_local gen_ctx_t *gen_arena;
+
+#define mappair(pair) (g->map[pair[dim_y]][pair[dim_x]])
+#define mapxy(x, y) (g->map[y][x])
+#define heightpair(pair) (g->height[pair[dim_y]][pair[dim_x]])
+#define heightxy(x, y) (g->height[y][x])
+
 /* Even unallocated, a WORLD_SIZE x WORLD_SIZE array of pointers is a very *
  * large thing to put on the stack.  To avoid that, world is a global.     */
 class world world;
@@ -34,6 +56,84 @@ pair_t all_dirs[8] = {
   {  1,  1 },
 };
 
+static gen_ctx_t *gen_ctx_get()
+{
+  int32_t x, y;
+
+  if (!gen_arena) {
+    gen_arena = (gen_ctx_t *) malloc(sizeof (*gen_arena));
+    for (y = 0; y < MAP_Y; y++) {
+      for (x = 0; x < MAP_X; x++) {
+        gen_arena->path[y][x].pos[dim_y] = y;
+        gen_arena->path[y][x].pos[dim_x] = x;
+        /* dijkstra_path() never queues the border, but looks at it */
+        gen_arena->path[y][x].hn = NULL;
+      }
+    }
+  }
+
+  return gen_arena;
+}
+
+static void gen_ctx_release()
+{
+  free(gen_arena);
+  gen_arena = NULL;
+}
+
+static inline void frontier_reset(gen_ctx_t *g)
+{
+  g->head = g->count = 0;
+}
+
+static inline void frontier_push(gen_ctx_t *g, int32_t x, int32_t y)
+{
+  queue_node_t *q;
+
+  assert(g->count < MAP_Y * MAP_X);
+  q = &g->frontier[(g->head + g->count++) % (MAP_Y * MAP_X)];
+  q->x = x;
+  q->y = y;
+}
+
+static inline int frontier_pop(gen_ctx_t *g, int32_t *x, int32_t *y)
+{
+  if (!g->count) {
+    return 0;
+  }
+
+  *x = g->frontier[g->head].x;
+  *y = g->frontier[g->head].y;
+  g->head = (g->head + 1) % (MAP_Y * MAP_X);
+  g->count--;
+
+  return 1;
+}
+
+/* Picks a cell uniformly from those set in cells.  Returns nonzero, *
+ * leaving p untouched, if there are none.                           */
+static int rand_cell(const row_t cells[MAP_Y], pair_t p)
+{
+  int32_t y, n, count;
+
+  for (count = 0, y = 0; y < MAP_Y; y++) {
+    count += row_popcount(cells[y]);
+  }
+
+  if (!count) {
+    return 1;
+  }
+
+  for (n = rand() % count, y = 0; n >= (count = row_popcount(cells[y])); y++) {
+    n -= count;
+  }
+
+  p[dim_x] = row_select(cells[y], n);
+  p[dim_y] = y;
+
+  return 0;
+}
+
 static int32_t path_cmp(const void *key, const void *with) {
   return ((path_t *) key)->cost - ((path_t *) with)->cost;
 }
@@ -43,23 +143,12 @@ static int32_t edge_penalty(int8_t x, int8_t y)
   return (x == 1 || y == 1 || x == MAP_X - 2 || y == MAP_Y - 2) ? 2 : 1;
 }
 
-static void dijkstra_path(map *m, pair_t from, pair_t to)
+static void dijkstra_path(gen_ctx_t *g, pair_t from, pair_t to)
 {
-  static path_t path[MAP_Y][MAP_X], *p;
-  static uint32_t initialized = 0;
+  path_t (*path)[MAP_X] = g->path, *p;
   heap_t h;
   int32_t x, y;
 
-  if (!initialized) {
-    for (y = 0; y < MAP_Y; y++) {
-      for (x = 0; x < MAP_X; x++) {
-        path[y][x].pos[dim_y] = y;
-        path[y][x].pos[dim_x] = x;
-      }
-    }
-    initialized = 1;
-  }
-  
   for (y = 0; y < MAP_Y; y++) {
     for (x = 0; x < MAP_X; x++) {
       path[y][x].cost = INT_MAX;
@@ -69,6 +158,7 @@ static void dijkstra_path(map *m, pair_t from, pair_t to)
   path[from[dim_y]][from[dim_x]].cost = 0;
 
   heap_init(&h, path_cmp, NULL);
+  PROF_HEAP(&h, prof_heap(prof_heap_paths));
 
   for (y = 1; y < MAP_Y - 1; y++) {
     for (x = 1; x < MAP_X - 1; x++) {
@@ -144,9 +234,18 @@ static void dijkstra_path(map *m, pair_t from, pair_t to)
   }
 }
 
-static int build_paths(map *m)
+#ifdef POKE327_BENCH
+/* The benchmarks run this over whatever map was generated last */
+void bench_dijkstra_path(pair_t from, pair_t to)
+{
+  dijkstra_path(gen_ctx_get(), from, to);
+}
+#endif
+
+static int build_paths(map *m, gen_ctx_t *g)
 {
   pair_t from, to;
+  PROF_SCOPE(prof_build_paths);
 
   /*  printf("%d %d %d %d\n", m->n, m->s, m->e, m->w);*/
 
@@ -156,7 +255,7 @@ static int build_paths(map *m)
     from[dim_y] = m->w;
     to[dim_y] = m->e;
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   if (m->n != -1 && m->s != -1) {
@@ -165,7 +264,7 @@ static int build_paths(map *m)
     from[dim_x] = m->n;
     to[dim_x] = m->s;
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   if (m->e == -1) {
@@ -181,7 +280,7 @@ static int build_paths(map *m)
       to[dim_y] = MAP_Y - 2;
     }
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   if (m->w == -1) {
@@ -197,7 +296,7 @@ static int build_paths(map *m)
       to[dim_y] = MAP_Y - 2;
     }
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   if (m->n == -1) {
@@ -213,7 +312,7 @@ static int build_paths(map *m)
       to[dim_y] = MAP_Y - 2;
     }
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   if (m->s == -1) {
@@ -229,7 +328,7 @@ static int build_paths(map *m)
       to[dim_y] = 1;
     }
 
-    dijkstra_path(m, from, to);
+    dijkstra_path(g, from, to);
   }
 
   return 0;
@@ -243,15 +342,16 @@ static int gaussian[5][5] = {
   {  1,  4,  7,  4,  1 }
 };
 
-static int smooth_height(map *m)
+static int smooth_height(gen_ctx_t *g)
 {
   int32_t i, x, y;
   int32_t s, t, p, q;
-  queue_node_t *head, *tail, *tmp;
   /*  FILE *out;*/
-  uint8_t height[MAP_Y][MAP_X];
+  uint8_t (*height)[MAP_X] = g->diffused;
+  PROF_SCOPE(prof_smooth_height);
 
-  memset(&height, 0, sizeof (height));
+  memset(g->diffused, 0, sizeof (g->diffused));
+  frontier_reset(g);
 
   /* Seed with some values */
   for (i = 1; i < 255; i += 20) {
@@ -260,98 +360,52 @@ static int smooth_height(map *m)
       y = rand() % MAP_Y;
     } while (height[y][x]);
     height[y][x] = i;
-    if (i == 1) {
-      head = tail = (queue_node_t *) malloc(sizeof (*tail));
-    } else {
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-    }
-    tail->next = NULL;
-    tail->x = x;
-    tail->y = y;
+    frontier_push(g, x, y);
   }
 
   /*
   out = fopen("seeded.pgm", "w");
   fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&height, sizeof (height), 1, out);
+  fwrite(g->diffused, sizeof (g->diffused), 1, out);
   fclose(out);
   */
   
   /* Diffuse the vaules to fill the space */
-  while (head) {
-    x = head->x;
-    y = head->y;
+  while (frontier_pop(g, &x, &y)) {
     i = height[y][x];
 
     if (x - 1 >= 0 && y - 1 >= 0 && !height[y - 1][x - 1]) {
       height[y - 1][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y - 1;
+      frontier_push(g, x - 1, y - 1);
     }
     if (x - 1 >= 0 && !height[y][x - 1]) {
       height[y][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y;
+      frontier_push(g, x - 1, y);
     }
     if (x - 1 >= 0 && y + 1 < MAP_Y && !height[y + 1][x - 1]) {
       height[y + 1][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y + 1;
+      frontier_push(g, x - 1, y + 1);
     }
     if (y - 1 >= 0 && !height[y - 1][x]) {
       height[y - 1][x] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x;
-      tail->y = y - 1;
+      frontier_push(g, x, y - 1);
     }
     if (y + 1 < MAP_Y && !height[y + 1][x]) {
       height[y + 1][x] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x;
-      tail->y = y + 1;
+      frontier_push(g, x, y + 1);
     }
     if (x + 1 < MAP_X && y - 1 >= 0 && !height[y - 1][x + 1]) {
       height[y - 1][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y - 1;
+      frontier_push(g, x + 1, y - 1);
     }
     if (x + 1 < MAP_X && !height[y][x + 1]) {
       height[y][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y;
+      frontier_push(g, x + 1, y);
     }
     if (x + 1 < MAP_X && y + 1 < MAP_Y && !height[y + 1][x + 1]) {
       height[y + 1][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y + 1;
+      frontier_push(g, x + 1, y + 1);
     }
-
-    tmp = head;
-    head = head->next;
-    free(tmp);
   }
 
   /* And smooth it a bit with a gaussian convolution */
@@ -366,7 +420,7 @@ static int smooth_height(map *m)
           }
         }
       }
-      m->height[y][x] = t / s;
+      g->height[y][x] = t / s;
     }
   }
   /* Let's do it again, until it's smooth like Kenny G. */
@@ -381,61 +435,77 @@ static int smooth_height(map *m)
           }
         }
       }
-      m->height[y][x] = t / s;
+      g->height[y][x] = t / s;
     }
   }
 
   /*
   out = fopen("diffused.pgm", "w");
   fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&height, sizeof (height), 1, out);
+  fwrite(g->diffused, sizeof (g->diffused), 1, out);
   fclose(out);
 
   out = fopen("smoothed.pgm", "w");
   fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->height, sizeof (m->height), 1, out);
+  fwrite(g->height, sizeof (g->height), 1, out);
   fclose(out);
   */
 
   return 0;
 }
 
-static void find_building_location(map *m, pair_t p)
+/* Cells of generated row y whose terrain is in cls */
+static row_t gen_row(gen_ctx_t *g, uint32_t cls, int32_t y)
 {
-  do {
-    p[dim_x] = rand() % (MAP_X - 3) + 1;
-    p[dim_y] = rand() % (MAP_Y - 3) + 1;
-
-    if ((((mapxy(p[dim_x] - 1, p[dim_y]    ) == ter_path)     &&
-          (mapxy(p[dim_x] - 1, p[dim_y] + 1) == ter_path))    ||
-         ((mapxy(p[dim_x] + 2, p[dim_y]    ) == ter_path)     &&
-          (mapxy(p[dim_x] + 2, p[dim_y] + 1) == ter_path))    ||
-         ((mapxy(p[dim_x]    , p[dim_y] - 1) == ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] - 1) == ter_path))    ||
-         ((mapxy(p[dim_x]    , p[dim_y] + 2) == ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 2) == ter_path)))   &&
-        (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_mart)     &&
-          (mapxy(p[dim_x]    , p[dim_y]    ) != ter_center)   &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_mart)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_center)   &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_mart)     &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_center)   &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_mart)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_center))) &&
-        (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_path)     &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_path)))) {
-          break;
+  row_t r;
+  int32_t x;
+
+  for (r = 0, x = 0; x < MAP_X; x++) {
+    if ((cls >> g->map[y][x]) & 1) {
+      r |= row_bit(x);
     }
-  } while (1);
+  }
+
+  return r;
+}
+
+/* Finds the top-left corner of a 2x2 building site: not on a path or     *
+ * another building, with a path running along one full side.  Returns    *
+ * nonzero, leaving p untouched, if the map has no such site.             */
+static int find_building_location(gen_ctx_t *g, pair_t p)
+{
+  row_t path[MAP_Y], used[MAP_Y], site[MAP_Y], along, blocked;
+  int32_t y;
+
+  for (y = 0; y < MAP_Y; y++) {
+    path[y] = gen_row(g, ter_mask(ter_path), y);
+    used[y] = path[y] | gen_row(g, ter_mask(ter_mart) |
+                                   ter_mask(ter_center), y);
+  }
+
+  memset(site, 0, sizeof (site));
+  for (y = 1; y < MAP_Y - 2; y++) {
+    along = path[y] & path[y + 1];
+    blocked = used[y] | used[y + 1];
+    site[y] = (((along << 1)                        |  /* West  */
+                (along >> 2)                        |  /* East  */
+                (path[y - 1] & (path[y - 1] >> 1))  |  /* North */
+                (path[y + 2] & (path[y + 2] >> 1))) &  /* South */
+               ~(blocked | (blocked >> 1))           &
+               row_span(1, MAP_X - 3));
+  }
+
+  return rand_cell(site, p);
 }
 
-static int place_pokemart(map *m)
+static int place_pokemart(gen_ctx_t *g)
 {
   pair_t p;
+  PROF_SCOPE(prof_place_buildings);
 
-  find_building_location(m, p);
+  if (find_building_location(g, p)) {
+    return 1;
+  }
 
   mapxy(p[dim_x]    , p[dim_y]    ) = ter_mart;
   mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_mart;
@@ -445,10 +515,13 @@ static int place_pokemart(map *m)
   return 0;
 }
 
-static int place_center(map *m)
+static int place_center(gen_ctx_t *g)
 {  pair_t p;
+  PROF_SCOPE(prof_place_buildings);
 
-  find_building_location(m, p);
+  if (find_building_location(g, p)) {
+    return 1;
+  }
 
   mapxy(p[dim_x]    , p[dim_y]    ) = ter_center;
   mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_center;
@@ -460,7 +533,7 @@ static int place_center(map *m)
 
 /* Chooses tree or boulder for border cell.  Choice is biased by dominance *
  * of neighboring cells.                                                   */
-static terrain_type_t border_type(map *m, int32_t x, int32_t y)
+static terrain_type_t border_type(gen_ctx_t *g, int32_t x, int32_t y)
 {
   int32_t p, q;
   int32_t r, t;
@@ -476,11 +549,11 @@ static terrain_type_t border_type(map *m, int32_t x, int32_t y)
   for (q = miny; q < maxy; q++) {
     for (p = minx; p < maxx; p++) {
       if (q != y || p != x) {
-        if (m->map[q][p] == ter_mountain ||
-            m->map[q][p] == ter_boulder) {
+        if (g->map[q][p] == ter_mountain ||
+            g->map[q][p] == ter_boulder) {
           r++;
-        } else if (m->map[q][p] == ter_forest ||
-                   m->map[q][p] == ter_tree) {
+        } else if (g->map[q][p] == ter_forest ||
+                   g->map[q][p] == ter_tree) {
           t++;
         }
       }
@@ -504,14 +577,15 @@ static terrain_type_t border_type(map *m, int32_t x, int32_t y)
   }
 }
 
-static int map_terrain(map *m, int8_t n, int8_t s, int8_t e, int8_t w)
+static int map_terrain(map *m, gen_ctx_t *g,
+                       int8_t n, int8_t s, int8_t e, int8_t w)
 {
   int32_t i, x, y;
-  queue_node_t *head, *tail, *tmp;
   //  FILE *out;
   int num_grass, num_clearing, num_mountain, num_forest, num_water, num_total;
   terrain_type_t type;
   int added_current = 0;
+  PROF_SCOPE(prof_map_terrain);
   
   num_grass = rand() % 4 + 2;
   num_clearing = rand() % 4 + 2;
@@ -520,14 +594,15 @@ static int map_terrain(map *m, int8_t n, int8_t s, int8_t e, int8_t w)
   num_water = rand() % 2 + 1;
   num_total = num_grass + num_clearing + num_mountain + num_forest + num_water;
 
-  memset(&m->map, 0, sizeof (m->map));
+  memset(&g->map, 0, sizeof (g->map));
+  frontier_reset(g);
 
   /* Seed with some values */
   for (i = 0; i < num_total; i++) {
     do {
       x = rand() % MAP_X;
       y = rand() % MAP_Y;
-    } while (m->map[y][x]);
+    } while (g->map[y][x]);
     if (i == 0) {
       type = ter_grass;
     } else if (i == num_grass) {
@@ -539,117 +614,72 @@ static int map_terrain(map *m, int8_t n, int8_t s, int8_t e, int8_t w)
     } else if (i == num_grass + num_clearing + num_mountain + num_forest) {
       type = ter_water;
     }
-    m->map[y][x] = type;
-    if (i == 0) {
-      head = tail = (queue_node_t *) malloc(sizeof (*tail));
-    } else {
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-    }
-    tail->next = NULL;
-    tail->x = x;
-    tail->y = y;
+    g->map[y][x] = type;
+    frontier_push(g, x, y);
   }
 
   /*
   out = fopen("seeded.pgm", "w");
   fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->map, sizeof (m->map), 1, out);
+  fwrite(g->map, sizeof (g->map), 1, out);
   fclose(out);
   */
 
   /* Diffuse the vaules to fill the space */
-  while (head) {
-    x = head->x;
-    y = head->y;
-    type = m->map[y][x];
+  while (frontier_pop(g, &x, &y)) {
+    type = g->map[y][x];
     
-    if (x - 1 >= 0 && !m->map[y][x - 1]) {
+    if (x - 1 >= 0 && !g->map[y][x - 1]) {
       if ((rand() % 100) < 80) {
-        m->map[y][x - 1] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x - 1;
-        tail->y = y;
+        g->map[y][x - 1] = type;
+        frontier_push(g, x - 1, y);
       } else if (!added_current) {
         added_current = 1;
-        m->map[y][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
+        g->map[y][x] = type;
+        frontier_push(g, x, y);
       }
     }
 
-    if (y - 1 >= 0 && !m->map[y - 1][x]) {
+    if (y - 1 >= 0 && !g->map[y - 1][x]) {
       if ((rand() % 100) < 20) {
-        m->map[y - 1][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y - 1;
+        g->map[y - 1][x] = type;
+        frontier_push(g, x, y - 1);
       } else if (!added_current) {
         added_current = 1;
-        m->map[y][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
+        g->map[y][x] = type;
+        frontier_push(g, x, y);
       }
     }
 
-    if (y + 1 < MAP_Y && !m->map[y + 1][x]) {
+    if (y + 1 < MAP_Y && !g->map[y + 1][x]) {
       if ((rand() % 100) < 20) {
-        m->map[y + 1][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y + 1;
+        g->map[y + 1][x] = type;
+        frontier_push(g, x, y + 1);
       } else if (!added_current) {
         added_current = 1;
-        m->map[y][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
+        g->map[y][x] = type;
+        frontier_push(g, x, y);
       }
     }
 
-    if (x + 1 < MAP_X && !m->map[y][x + 1]) {
+    if (x + 1 < MAP_X && !g->map[y][x + 1]) {
       if ((rand() % 100) < 80) {
-        m->map[y][x + 1] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x + 1;
-        tail->y = y;
+        g->map[y][x + 1] = type;
+        frontier_push(g, x + 1, y);
       } else if (!added_current) {
         added_current = 1;
-        m->map[y][x] = type;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
+        g->map[y][x] = type;
+        frontier_push(g, x, y);
       }
     }
 
     added_current = 0;
-    tmp = head;
-    head = head->next;
-    free(tmp);
   }
 
   /*
   out = fopen("diffused.pgm", "w");
   fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->map, sizeof (m->map), 1, out);
+  fwrite(g->map, sizeof (g->map), 1, out);
   fclose(out);
   */
   
@@ -657,7 +687,7 @@ static int map_terrain(map *m, int8_t n, int8_t s, int8_t e, int8_t w)
     for (x = 0; x < MAP_X; x++) {
       if (y == 0 || y == MAP_Y - 1 ||
           x == 0 || x == MAP_X - 1) {
-        mapxy(x, y) = border_type(m, x, y);
+        mapxy(x, y) = border_type(g, x, y);
       }
     }
   }
@@ -687,223 +717,499 @@ static int map_terrain(map *m, int8_t n, int8_t s, int8_t e, int8_t w)
   return 0;
 }
 
-static int place_boulders(map *m)
+static int place_boulders(gen_ctx_t *g)
 {
   int i;
   int x, y;
+  PROF_SCOPE(prof_place_boulders);
 
   for (i = 0; i < MIN_BOULDERS || rand() % 100 < BOULDER_PROB; i++) {
     y = rand() % (MAP_Y - 2) + 1;
     x = rand() % (MAP_X - 2) + 1;
-    if (m->map[y][x] != ter_forest &&
-        m->map[y][x] != ter_path   &&
-        m->map[y][x] != ter_gate) {
-      m->map[y][x] = ter_boulder;
+    if (g->map[y][x] != ter_forest &&
+        g->map[y][x] != ter_path   &&
+        g->map[y][x] != ter_gate) {
+      g->map[y][x] = ter_boulder;
     }
   }
 
   return 0;
 }
 
-static int place_trees(map *m)
+static int place_trees(gen_ctx_t *g)
 {
   int i;
   int x, y;
+  PROF_SCOPE(prof_place_trees);
   
   for (i = 0; i < MIN_TREES || rand() % 100 < TREE_PROB; i++) {
     y = rand() % (MAP_Y - 2) + 1;
     x = rand() % (MAP_X - 2) + 1;
-    if (m->map[y][x] != ter_mountain &&
-        m->map[y][x] != ter_path     &&
-        m->map[y][x] != ter_water    &&
-        m->map[y][x] != ter_gate) {
-      m->map[y][x] = ter_tree;
+    if (g->map[y][x] != ter_mountain &&
+        g->map[y][x] != ter_path     &&
+        g->map[y][x] != ter_water    &&
+        g->map[y][x] != ter_gate) {
+      g->map[y][x] = ter_tree;
     }
   }
 
   return 0;
 }
 
-void rand_pos(pair_t pos)
+/* Copies the finished terrain out of the generation context into the map's *
+ * runtime representation.                                                 */
+static void commit_terrain(map *m, gen_ctx_t *g)
+{
+  int32_t x, y;
+
+  memset(m->ter, 0, sizeof (m->ter));
+  memset(m->ter_bits, 0, sizeof (m->ter_bits));
+  memset(m->pass, 0, sizeof (m->pass));
+  memset(m->nbr, 0, sizeof (m->nbr));
+
+  for (y = 0; y < MAP_Y; y++) {
+    for (x = 0; x < MAP_X; x++) {
+      ter_set(m, x, y, g->map[y][x]);
+    }
+  }
+}
+
+static uint16_t region_find(uint16_t *parent, uint16_t l)
+{
+  while (parent[l] != l) {
+    l = parent[l] = parent[parent[l]];
+  }
+
+  return l;
+}
+
+static void region_union(uint16_t *parent, uint16_t a, uint16_t b)
+{
+  a = region_find(parent, a);
+  b = region_find(parent, b);
+
+  if (a < b) {
+    parent[b] = a;
+  } else {
+    parent[a] = b;
+  }
+}
+
+/* Classic two-pass connected component labeling with union-find.  The *
+ * first pass hands out provisional labels and records equivalences   *
+ * with the already-visited neighbors (W, NW, N, NE); the second pass  *
+ * replaces each label with its root, renumbered densely from 1.       */
+static void label_regions(const row_t open[MAP_Y],
+                          uint16_t region[MAP_Y][MAP_X])
+{
+  static const int8_t before[4][2] = {{ -1, 0 }, { -1, -1 },
+                                      {  0, -1 }, {  1, -1 }};
+  uint16_t parent[MAP_Y * MAP_X], dense[MAP_Y * MAP_X];
+  uint16_t next, l, n;
+  int32_t x, y, i;
+
+  memset(region, 0, MAP_Y * sizeof (*region));
+
+  for (next = 1, y = 1; y < MAP_Y - 1; y++) {
+    for (x = 1; x < MAP_X - 1; x++) {
+      if (!row_test(open[y], x)) {
+        continue;
+      }
+      for (l = 0, i = 0; i < 4; i++) {
+        if ((n = region[y + before[i][1]][x + before[i][0]])) {
+          if (!l) {
+            l = n;
+          } else if (n != l) {
+            region_union(parent, l, n);
+          }
+        }
+      }
+      if (!l) {
+        l = next;
+        parent[next++] = l;
+      }
+      region[y][x] = l;
+    }
+  }
+
+  memset(dense, 0, next * sizeof (*dense));
+  for (n = 0, y = 1; y < MAP_Y - 1; y++) {
+    for (x = 1; x < MAP_X - 1; x++) {
+      if ((l = region[y][x])) {
+        l = region_find(parent, l);
+        if (!dense[l]) {
+          dense[l] = ++n;
+        }
+        region[y][x] = dense[l];
+      }
+    }
+  }
+}
+
+static void label_map_regions(map *m)
+{
+  row_t swim[MAP_Y], water;
+  int32_t y;
+  PROF_SCOPE(prof_label_regions);
+
+  label_regions(m->pass[char_pc], m->region[region_pc]);
+
+  /* Swimmers stay in the water, but may cross bridges */
+  memset(swim, 0, sizeof (swim));
+  for (y = 1; y < MAP_Y - 1; y++) {
+    water = (m->ter_bits[ter_water][y - 1] | m->ter_bits[ter_water][y] |
+             m->ter_bits[ter_water][y + 1]);
+    swim[y] = (m->ter_bits[ter_water][y] |
+               (m->ter_bits[ter_path][y] &
+                (water | (water << 1) | (water >> 1))));
+  }
+  label_regions(swim, m->region[region_swim]);
+}
+
+/* Works out m's distances to facility f, found on terrain of class cls */
+static void find_facility(map *m, facility_t f, uint32_t cls)
+{
+  int dist[MAP_Y][MAP_X];
+  int32_t x, y;
+
+  pc_dist_to(m, cls, dist);
+  for (y = 0; y < MAP_Y; y++) {
+    for (x = 0; x < MAP_X; x++) {
+      m->facility[f][y][x] = (dist[y][x] == DIJKSTRA_PATH_MAX ?
+                              FACILITY_FAR : dist[y][x]);
+    }
+  }
+}
+
+static void find_facilities(map *m)
+{
+  PROF_SCOPE(prof_find_facilities);
+
+  find_facility(m, fac_mart, ter_mask(ter_mart));
+  find_facility(m, fac_center, ter_mask(ter_center));
+}
+
+/* The region, for movement class k, holding the path network that     *
+ * joins the gates; that is, the part of the map a trainer arriving     *
+ * through any gate can get to.  The gates themselves may have been     *
+ * buried under boulders, so go by the first path cell instead.  Paths  *
+ * run gate to gate and always cross, so any one of them will do.  Zero *
+ * if the map has no paths or k can't move along them.                  */
+uint16_t gate_region(const map *m, region_class_t k)
+{
+  int32_t y;
+
+  for (y = 1; y < MAP_Y - 1; y++) {
+    if (m->ter_bits[ter_path][y]) {
+      return region_at(m, k, row_ctz(m->ter_bits[ter_path][y]), y);
+    }
+  }
+
+  return 0;
+}
+
+/* The cells of region r, for movement class k; none if r is zero */
+static void region_cells(const map *m, region_class_t k, uint16_t r,
+                         row_t cells[MAP_Y])
+{
+  int32_t x, y;
+
+  memset(cells, 0, MAP_Y * sizeof (*cells));
+  if (!r) {
+    return;
+  }
+
+  for (y = 1; y < MAP_Y - 1; y++) {
+    for (x = 1; x < MAP_X - 1; x++) {
+      if (region_at(m, k, x, y) == r) {
+        cells[y] |= row_bit(x);
+      }
+    }
+  }
+}
+
+/* Picks a free cell of the gate region to teleport the PC to, so that it *
+ * can always walk off the map again.  Returns nonzero, leaving pos       *
+ * untouched, if there's no such cell.                                     */
+int teleport_pos(const map *m, pair_t pos)
+{
+  row_t cells[MAP_Y];
+  int32_t x, y;
+
+  region_cells(m, region_pc, gate_region(m, region_pc), cells);
+  for (y = 1; y < MAP_Y - 1; y++) {
+    for (x = 1; x < MAP_X - 1; x++) {
+      if (m->cmap[y][x]) {
+        cells[y] &= ~row_bit(x);
+      }
+    }
+  }
+
+  return rand_cell(cells, pos);
+}
+
+/* Cells already claimed while placing characters on the current map */
+static row_t occupied[MAP_Y];
+
+/* Cells from which hikers and rivals can get to the PC, while placing them */
+static row_t hiker_reach[MAP_Y], rival_reach[MAP_Y];
+
+/* Free cells of reach at least three cells in from the border */
+static int rand_trainer_pos(const row_t reach[MAP_Y], pair_t pos)
+{
+  row_t cells[MAP_Y];
+  int32_t y;
+
+  memset(cells, 0, sizeof (cells));
+  for (y = 3; y < MAP_Y - 3; y++) {
+    cells[y] = reach[y] & ~occupied[y] & row_span(3, MAP_X - 4);
+  }
+
+  return rand_cell(cells, pos);
+}
+
+/* Moves s's NPCs into a fresh block with room for cap of them.  Fields *
+ * are laid out widest first, so each array starts suitably aligned.    */
+static void npc_store_resize(npc_store_t *s, char_id_t cap)
 {
-  pos[dim_x] = (rand() % (MAP_X - 2)) + 1;
-  pos[dim_y] = (rand() % (MAP_Y - 2)) + 1;
+  npc_store_t n;
+  uint32_t size;
+  char *p;
+
+  size = NPC_FIRST + cap;
+#define NPC_FIELD(f)                                              \
+  n.f = (__typeof__ (n.f)) p;                                     \
+  p += size * sizeof (*n.f);                                      \
+  if (s->count) {                                                 \
+    memcpy(n.f, s->f, (NPC_FIRST + s->count) * sizeof (*n.f));    \
+  }
+  p = (char *) malloc(size * (sizeof (*n.hn) + sizeof (*n.next_turn) +
+                              sizeof (*n.seq_num) + sizeof (*n.pos) +
+                              sizeof (*n.dir) + sizeof (*n.ctype) +
+                              sizeof (*n.mtype) + sizeof (*n.defeated) +
+                              sizeof (*n.dormant) + sizeof (*n.symbol)));
+  NPC_FIELD(hn);
+  NPC_FIELD(next_turn);
+  NPC_FIELD(seq_num);
+  NPC_FIELD(pos);
+  NPC_FIELD(dir);
+  NPC_FIELD(ctype);
+  NPC_FIELD(mtype);
+  NPC_FIELD(defeated);
+  NPC_FIELD(dormant);
+  NPC_FIELD(symbol);
+#undef NPC_FIELD
+
+  free(s->hn);
+  n.count = s->count;
+  n.cap = cap;
+  *s = n;
+}
+
+static char_id_t new_npc(pair_t pos, character_type_t ctype,
+                         movement_type_t mtype, char symbol)
+{
+  npc_store_t *s = &world.cur_map->npc;
+  char_id_t c;
+
+  /* Doubling while placing; place_characters() trims it after */
+  if (s->count == s->cap) {
+    npc_store_resize(s, s->cap ? 2 * s->cap : MIN_TRAINERS * 2);
+  }
+
+  c = NPC_FIRST + s->count++;
+  cmap_set(world.cur_map, pos[dim_x], pos[dim_y], c);
+  occupied[pos[dim_y]] |= row_bit(pos[dim_x]);
+  s->pos[c][dim_y] = pos[dim_y];
+  s->pos[c][dim_x] = pos[dim_x];
+  s->dir[c][dim_y] = 0;
+  s->dir[c][dim_x] = 0;
+  s->ctype[c] = ctype;
+  s->mtype[c] = mtype;
+  s->symbol[c] = symbol;
+  s->defeated[c] = 0;
+  s->dormant[c] = 0;
+  s->hn[c] = NULL;
+  s->next_turn[c] = 0;
+  s->seq_num[c] = world.char_seq_num++;
+
+  return c;
 }
 
-void new_hiker()
+int new_hiker()
 {
   pair_t pos;
-  npc *c;
+  char_id_t c;
 
-  do {
-    rand_pos(pos);
-  } while (world.hiker_dist[pos[dim_y]][pos[dim_x]] == DIJKSTRA_PATH_MAX ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]                   ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4                      ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
-
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_hiker;
-  c->mtype = move_hiker;
-  c->dir[dim_x] = 0;
-  c->dir[dim_y] = 0;
-  c->defeated = 0;
-  c->symbol = HIKER_SYMBOL;
-  c->next_turn = 0;
-  c->seq_num = world.char_seq_num++;
-  heap_insert(&world.cur_map->turn, c);
+  if (rand_trainer_pos(hiker_reach, pos)) {
+    return 1;
+  }
+
+  c = new_npc(pos, char_hiker, move_hiker, HIKER_SYMBOL);
+  npc_schedule(world.cur_map, c);
+
+  return 0;
 }
 
-void new_rival()
+int new_rival()
 {
   pair_t pos;
-  npc *c;
+  char_id_t c;
 
-  do {
-    rand_pos(pos);
-  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == DIJKSTRA_PATH_MAX ||
-           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0                  ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]                   ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4                      ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
-
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_rival;
-  c->mtype = move_rival;
-  c->dir[dim_x] = 0;
-  c->dir[dim_y] = 0;
-  c->defeated = 0;
-  c->symbol = RIVAL_SYMBOL;
-  c->next_turn = 0;
-  c->seq_num = world.char_seq_num++;
-  heap_insert(&world.cur_map->turn, c);
+  if (rand_trainer_pos(rival_reach, pos)) {
+    return 1;
+  }
+
+  c = new_npc(pos, char_rival, move_rival, RIVAL_SYMBOL);
+  npc_schedule(world.cur_map, c);
+
+  return 0;
 }
 
-void new_swimmer()
+int new_swimmer()
 {
+  row_t cells[MAP_Y];
   pair_t pos;
-  npc *c;
+  char_id_t c;
+  int32_t y;
 
-  do {
-    rand_pos(pos);
-  } while (world.cur_map->map[pos[dim_y]][pos[dim_x]] != ter_water ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]);
-
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_swimmer;
-  c->mtype = move_swim;
-  rand_dir(c->dir);
-  c->defeated = 0;
-  c->symbol = SWIMMER_SYMBOL;
-  c->next_turn = 0;
-  c->seq_num = world.char_seq_num++;
-  heap_insert(&world.cur_map->turn, c);
+  memset(cells, 0, sizeof (cells));
+  for (y = 1; y < MAP_Y - 1; y++) {
+    cells[y] = (world.cur_map->ter_bits[ter_water][y] & ~occupied[y] &
+                ROW_INTERIOR);
+  }
+
+  if (rand_cell(cells, pos)) {
+    return 1;
+  }
+
+  c = new_npc(pos, char_swimmer, move_swim, SWIMMER_SYMBOL);
+  rand_dir(world.cur_map->npc.dir[c]);
+  npc_schedule(world.cur_map, c);
+
+  return 0;
 }
 
-void new_char_other()
+int new_char_other()
 {
   pair_t pos;
-  npc *c;
+  char_id_t c;
+
+  if (rand_trainer_pos(rival_reach, pos)) {
+    return 1;
+  }
 
-  do {
-    rand_pos(pos);
-  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == DIJKSTRA_PATH_MAX ||
-           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0                  ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]                   ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4                      ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
-
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_other;
   switch (rand() % 4) {
   case 0:
-    c->mtype = move_pace;
-    c->symbol = PACER_SYMBOL;
+    c = new_npc(pos, char_other, move_pace, PACER_SYMBOL);
     break;
   case 1:
-    c->mtype = move_wander;
-    c->symbol = WANDERER_SYMBOL;
+    c = new_npc(pos, char_other, move_wander, WANDERER_SYMBOL);
     break;
   case 2:
-    c->mtype = move_sentry;
-    c->symbol = SENTRY_SYMBOL;
+    c = new_npc(pos, char_other, move_sentry, SENTRY_SYMBOL);
     break;
-  case 3:
-    c->mtype = move_explore;
-    c->symbol = EXPLORER_SYMBOL;
+  default:
+    c = new_npc(pos, char_other, move_explore, EXPLORER_SYMBOL);
     break;
   }
-  rand_dir(c->dir);
-  c->defeated = 0;
-  c->next_turn = 0;
-  c->seq_num = world.char_seq_num++;
-  heap_insert(&world.cur_map->turn, c);
+  rand_dir(world.cur_map->npc.dir[c]);
+  npc_schedule(world.cur_map, c);
+
+  return 0;
+}
+
+/* Nonzero if any kind of trainer still fits on the map */
+static int trainer_room()
+{
+  int32_t y;
+
+  for (y = 1; y < MAP_Y - 1; y++) {
+    if (world.cur_map->ter_bits[ter_water][y] & ROW_INTERIOR & ~occupied[y]) {
+      return 1;
+    }
+  }
+  for (y = 3; y < MAP_Y - 3; y++) {
+    if ((hiker_reach[y] | rival_reach[y]) &
+        row_span(3, MAP_X - 4) & ~occupied[y]) {
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
 void place_characters()
 {
-  world.cur_map->num_trainers = 3;
+  int failed;
+  PROF_SCOPE(prof_place_characters);
+
+  memset(occupied, 0, sizeof (occupied));
+  occupied[world.pc.pos[dim_y]] = row_bit(world.pc.pos[dim_x]);
+  flood_fill(world.cur_map->pass[char_hiker],
+             world.pc.pos[dim_x], world.pc.pos[dim_y], hiker_reach);
+  flood_fill(world.cur_map->pass[char_rival],
+             world.pc.pos[dim_x], world.pc.pos[dim_y], rival_reach);
 
   //Always place a hiker and a rival, then place a random number of others
-  new_hiker();
-  new_rival();
-  new_swimmer();
+  world.cur_map->num_trainers = (!new_hiker() + !new_rival() +
+                                 !new_swimmer());
   do {
     //higher probability of non- hikers and rivals
     switch(rand() % 10) {
     case 0:
-      new_hiker();
+      failed = new_hiker();
       break;
     case 1:
-      new_rival();
+      failed = new_rival();
       break;
     case 2:
-      new_swimmer();
+      failed = new_swimmer();
       break;
     default:
-      new_char_other();
+      failed = new_char_other();
       break;
     }
     /* Game attempts to continue to place trainers until the probability *
-     * roll fails, but if the map is full (or almost full), it's         *
-     * impossible (or very difficult) to continue to add, so we abort if *
-     * we've tried MAX_TRAINER_TRIES times.                              */
-  } while (++world.cur_map->num_trainers < MIN_TRAINERS ||
-           ((rand() % 100) < ADD_TRAINER_PROB));
+     * roll fails.  Placement only ever picks from cells that are still  *
+     * free, so a trainer that doesn't fit costs one roll rather than an *
+     * unbounded search, and once nothing fits anywhere we stop.         */
+  } while (failed ? trainer_room() :
+           (++world.cur_map->num_trainers < MIN_TRAINERS ||
+            ((rand() % 100) < ADD_TRAINER_PROB)));
+
+  npc_store_resize(&world.cur_map->npc, world.cur_map->npc.count);
 }
 
 void init_pc()
 {
-  int x, y;
+  row_t cells[MAP_Y];
+  pair_t pos;
+  int32_t y;
 
-  do {
-    x = rand() % (MAP_X - 2) + 1;
-    y = rand() % (MAP_Y - 2) + 1;
-  } while (world.cur_map->map[y][x] != ter_path);
+  memset(cells, 0, sizeof (cells));
+  for (y = 1; y < MAP_Y - 1; y++) {
+    cells[y] = world.cur_map->ter_bits[ter_path][y] & ROW_INTERIOR;
+  }
+
+  /* Every map has paths through its interior */
+  rand_cell(cells, pos);
 
-  world.pc.pos[dim_x] = x;
-  world.pc.pos[dim_y] = y;
+  world.pc.pos[dim_x] = pos[dim_x];
+  world.pc.pos[dim_y] = pos[dim_y];
   world.pc.symbol = PC_SYMBOL;
 
-  world.cur_map->cmap[y][x] = &world.pc;
+  cmap_set(world.cur_map, pos[dim_x], pos[dim_y], CHAR_PC);
   world.pc.next_turn = 0;
 
   world.pc.seq_num = world.char_seq_num++;
 
-  heap_insert(&world.cur_map->turn, &world.pc);
+  heap_insert(&world.cur_map->turn, turn_datum(CHAR_PC));
 }
 
 void place_pc()
 {
-  character *c;
+  void *c;
 
   if (world.pc.pos[dim_x] == 1) {
     world.pc.pos[dim_x] = MAP_X - 2;
@@ -915,13 +1221,16 @@ void place_pc()
     world.pc.pos[dim_y] = 1;
   }
 
-  world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = &world.pc;
+  cmap_set(world.cur_map, world.pc.pos[dim_x], world.pc.pos[dim_y], CHAR_PC);
 
-  if ((c = (character *) heap_peek_min(&world.cur_map->turn))) {
-    world.pc.next_turn = c->next_turn;
+  /* The PC is never in a queue it's about to join, so this is an NPC */
+  if ((c = heap_peek_min(&world.cur_map->turn))) {
+    world.pc.next_turn = world.cur_map->npc.next_turn[datum_turn(c)];
   } else {
     world.pc.next_turn = 0;
   }
+
+  wake_npcs(world.cur_map, 1);
 }
 
 // New map expects cur_idx to refer to the index to be generated.  If that
@@ -932,6 +1241,8 @@ int new_map(int teleport)
   int d, p;
   int e, w, n, s;
   int x, y;
+  pair_t pos;
+  gen_ctx_t *g;
   
   if (world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]]) {
     world.cur_map = world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]];
@@ -940,11 +1251,18 @@ int new_map(int teleport)
     return 0;
   }
 
+  PROF_SCOPE(prof_new_map);
+
   world.cur_map = new map;
   world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]] = world.cur_map;
+  world.resident = (map **) realloc(world.resident,
+                                    (world.num_resident + 1) *
+                                    sizeof (*world.resident));
+  world.resident[world.num_resident++] = world.cur_map;
     
+  g = gen_ctx_get();
 
-  smooth_height(world.cur_map);
+  smooth_height(g);
   
   if (!world.cur_idx[dim_y]) {
     n = -1;
@@ -975,29 +1293,43 @@ int new_map(int teleport)
     e = 3 + rand() % (MAP_Y - 6);
   }
   
-  map_terrain(world.cur_map, n, s, e, w);
+  map_terrain(world.cur_map, g, n, s, e, w);
      
-  place_boulders(world.cur_map);
-  place_trees(world.cur_map);
-  build_paths(world.cur_map);
+  place_boulders(g);
+  place_trees(g);
+  build_paths(world.cur_map, g);
   d = (abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)) +
        abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)));
   p = d > 200 ? 5 : (50 - ((45 * d) / 200));
   //  printf("d=%d, p=%d\n", d, p);
   if ((rand() % 100) < p || !d) {
-    place_pokemart(world.cur_map);
+    place_pokemart(g);
   }
   if ((rand() % 100) < p || !d) {
-    place_center(world.cur_map);
+    place_center(g);
   }
 
+  commit_terrain(world.cur_map, g);
+  label_map_regions(world.cur_map);
+  find_facilities(world.cur_map);
+  world.cur_map->gate_cost_known = 0;
+
   for (y = 0; y < MAP_Y; y++) {
     for (x = 0; x < MAP_X; x++) {
-      world.cur_map->cmap[y][x] = NULL;
+      cmap_set(world.cur_map, x, y, CHAR_NONE);
     }
   }
-
-  heap_init(&world.cur_map->turn, cmp_char_turns, delete_character);
+  memset(&world.cur_map->npc, 0, sizeof (world.cur_map->npc));
+  memset(world.cur_map->dormant, 0, sizeof (world.cur_map->dormant));
+  world.cur_map->clock = 0;
+  /* Off-screen randomness mustn't disturb rand(), which the rest of the *
+   * game shares, so each map's stream is seeded from where it is.        */
+  world.cur_map->rng = (world.seed ^ (world.cur_idx[dim_y] * WORLD_SIZE +
+                                      world.cur_idx[dim_x]) * 2654435761U);
+
+  heap_init(&world.cur_map->turn, cmp_char_turns, NULL);
+  memset(&world.cur_map->turn_stats, 0, sizeof (world.cur_map->turn_stats));
+  PROF_HEAP(&world.cur_map->turn, &world.cur_map->turn_stats);
 
   if ((world.cur_idx[dim_x] == WORLD_SIZE / 2) &&
       (world.cur_idx[dim_y] == WORLD_SIZE / 2)) {
@@ -1006,21 +1338,17 @@ int new_map(int teleport)
     place_pc();
   }
 
-  pathfind(world.cur_map);
-  if (teleport) {
-    do {
-      world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = NULL;
-      world.pc.pos[dim_x] = rand_range(1, MAP_X - 2);
-      world.pc.pos[dim_y] = rand_range(1, MAP_Y - 2);
-    } while (world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] ||
-             (move_cost[char_pc][world.cur_map->map[world.pc.pos[dim_y]]
-                                                   [world.pc.pos[dim_x]]] ==
-              DIJKSTRA_PATH_MAX)                                           ||
-             world.rival_dist[world.pc.pos[dim_y]][world.pc.pos[dim_x]] < 0);
-    world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = &world.pc;
-    pathfind(world.cur_map);
+  /* Failing that, the PC stays by the gate it would have come through */
+  if (teleport && !teleport_pos(world.cur_map, pos)) {
+    cmap_set(world.cur_map,
+             world.pc.pos[dim_x], world.pc.pos[dim_y], CHAR_NONE);
+    world.pc.pos[dim_x] = pos[dim_x];
+    world.pc.pos[dim_y] = pos[dim_y];
+    cmap_set(world.cur_map, world.pc.pos[dim_x], world.pc.pos[dim_y], CHAR_PC);
   }
-  
+
+  /* The distance maps aren't needed until the PC's next turn, which *
+   * always recomputes them.                                          */
   place_characters();
 
   return 0;
@@ -1033,6 +1361,8 @@ void init_world()
   world.cur_idx[dim_x] = world.cur_idx[dim_y] = WORLD_SIZE / 2;
   world.char_seq_num = 0;
   new_map(0);
+  pathfind(world.cur_map);
+  find_swim_view(world.cur_map);
 }
 
 void delete_world()
@@ -1043,11 +1373,19 @@ void delete_world()
     for (x = 0; x < WORLD_SIZE; x++) {
       if (world.world[y][x]) {
         heap_delete(&world.world[y][x]->turn);
+        free(world.world[y][x]->npc.hn);
         delete world.world[y][x];
         world.world[y][x] = NULL;
       }
     }
   }
+
+  free(world.resident);
+  world.resident = NULL;
+  world.num_resident = 0;
+
+  gen_ctx_release();
+  heap_cache_release();
 }
 
 void print_hiker_dist()
@@ -1095,63 +1433,283 @@ void leave_map(pair_t d)
     world.cur_idx[dim_y]++;
   }
   new_map(0);
+  world.map_changes++;
+}
+
+static void sim_init(sim_t *s, map *m)
+{
+  s->m = m;
+  if (m == world.cur_map) {
+    s->pc = world.pc.pos;
+    s->hiker_dist = world.hiker_dist;
+    s->rival_dist = world.rival_dist;
+    s->swim_view = world.swim_view;
+    s->rng = NULL;
+  } else {
+    s->pc = NULL;
+    s->hiker_dist = s->rival_dist = NULL;
+    s->swim_view = NULL;
+    s->rng = &m->rng;
+  }
+  s->until = s->pc ? world.pc.next_turn : m->clock;
+  s->lod = world.lod;
+  s->npc_moves = 0;
+}
+
+static void step_npc(sim_t *s, char_id_t c)
+{
+  map *m = s->m;
+  int16_t *pos = m->npc.pos[c];
+  pair_t d;
+
+  /* NPCs on screen move exactly; off it they may cover ground at once */
+  if (s->lod && !s->pc) {
+    lod_func[m->npc.mtype[c]](s, c, d);
+  } else {
+    move_func[m->npc.mtype[c]](s, c, d);
+  }
+  s->npc_moves++;
+
+  cmap_set(m, pos[dim_x], pos[dim_y], CHAR_NONE);
+  cmap_set(m, d[dim_x], d[dim_y], c);
+
+  m->npc.next_turn[c] += move_cost[m->npc.ctype[c]]
+                                  [ter_at(m, d[dim_x], d[dim_y])];
+
+  pos[dim_y] = d[dim_y];
+  pos[dim_x] = d[dim_x];
+}
+
+/* True if c's turn comes before the PC's, or, with the PC elsewhere, *
+ * before the map's clock.                                            */
+static inline bool npc_due(sim_t *s, char_id_t c)
+{
+  return (s->pc ? cmp_char_turns(turn_datum(c), turn_datum(CHAR_PC)) < 0 :
+          s->m->npc.next_turn[c] < s->m->clock);
+}
+
+/* Runs every NPC turn that comes before the PC's next one.  Rather than *
+ * a trip through the turn queue per move, everything ahead of the PC is *
+ * drained into a buffer, which is already in turn order.  An NPC that  *
+ * is still ahead of the PC after moving is slid back into place in the *
+ * remainder of the buffer; the rest wait at the front.  Order, and so  *
+ * behavior, is exactly as if each move went through the queue.         */
+static void step_npcs(sim_t *s)
+{
+  char_id_t batch[NPC_MAX], c;
+  uint32_t head, tail, i;
+  map *m = s->m;
+  void *v;
+
+  for (tail = 0;
+       ((v = heap_peek_min(&m->turn)) && datum_turn(v) != CHAR_PC &&
+        npc_due(s, datum_turn(v)));
+       tail++) {
+    batch[tail] = datum_turn(heap_remove_min(&m->turn));
+    m->npc.hn[batch[tail]] = NULL;
+  }
+
+  for (head = 0; head < tail; ) {
+    c = batch[head];
+    step_npc(s, c);
+    if (!m->npc.dormant[c] && npc_due(s, c)) {
+      for (i = head;
+           (i + 1 < tail &&
+            cmp_char_turns(turn_datum(batch[i + 1]), turn_datum(c)) < 0);
+           i++) {
+        batch[i] = batch[i + 1];
+      }
+      batch[i] = c;
+    } else {
+      head++;
+    }
+  }
+
+  for (i = 0; i < tail; i++) {
+    if (!m->npc.dormant[batch[i]]) {
+      npc_schedule(m, batch[i]);
+    }
+  }
+}
+
+/* Maps off the PC's screen carry on in live mode, each on whichever    *
+ * worker thread gets to it.  NPCs never leave their maps and each map  *
+ * has its own random numbers, so the maps are independent and come out *
+ * the same no matter how the work is divided.  After every PC turn the *
+ * workers run each of these maps forward by as long as the turn took,  *
+ * while the main thread gets on with the PC's map; both are done by    *
+ * the time the PC moves again.                                         */
+static pool_t live_pool;
+static map *live_skip;
+
+static void live_task(void *arg, uint32_t i)
+{
+  map *m = world.resident[i];
+  sim_t s;
+
+  if (m == live_skip) {
+    return;
+  }
+
+  m->clock += *(int32_t *) arg;
+
+  turn_map = m;
+  sim_init(&s, m);
+  step_npcs(&s);
+  turn_map = NULL;
+
+  __atomic_fetch_add(&world.npc_moves, s.npc_moves, __ATOMIC_RELAXED);
+}
+
+static void live_step(int32_t elapsed)
+{
+  static int32_t delta;
+
+  delta = elapsed;
+  live_skip = world.cur_map;
+  pool_run(&live_pool, live_task, &delta, world.num_resident);
+}
+
+/* Profiling reports count every map's turn queue together, as the work *
+ * of the PC's turns.                                                    */
+static void profile_report(void)
+{
+#ifdef POKE327_PROFILE
+  heap_stats_t *t = prof_heap(prof_heap_turn);
+  uint32_t i;
+
+  memset(t, 0, sizeof (*t));
+  for (i = 0; i < world.num_resident; i++) {
+    heap_stats_merge(t, &world.resident[i]->turn_stats);
+  }
+#endif
+
+  prof_report(world.pc_turns);
 }
 
 void game_loop()
 {
-  character *c;
-  npc *n;
-  pc *p;
+  map *m;
+  sim_t s;
   pair_t d;
+  int32_t cost;
   
   while (!world.quit) {
-    c = (character *) heap_remove_min(&world.cur_map->turn);
-    n = dynamic_cast<npc *> (c);
-    p = dynamic_cast<pc *> (c);
+    sim_init(&s, world.cur_map);
+    step_npcs(&s);
+    __atomic_fetch_add(&world.npc_moves, s.npc_moves, __ATOMIC_RELAXED);
+
+    if (world.live) {
+      pool_wait(&live_pool);
+    }
 
-    move_func[n ? n->mtype : move_pc](c, d);
+    /* The workers are idle, so their maps' counts hold still */
+    if (prof_poll()) {
+      profile_report();
+    }
 
-    world.cur_map->cmap[c->pos[dim_y]][c->pos[dim_x]] = NULL;
-    if (p && (d[dim_x] == 0 || d[dim_x] == MAP_X - 1 ||
-              d[dim_y] == 0 || d[dim_y] == MAP_Y - 1)) {
-      leave_map(d);
-      d[dim_x] = c->pos[dim_x];
-      d[dim_y] = c->pos[dim_y];
+    m = world.cur_map;
+    heap_remove_min(&m->turn);
+    /* Where this map's clock stands if the PC leaves */
+    m->clock = world.pc.next_turn;
+
+    /* The PC may fly off to another map */
+    move_func[move_pc](&s, CHAR_PC, d);
+    /* Quitting doesn't take a turn, so nothing more happens */
+    if (world.quit) {
+      break;
     }
-    world.cur_map->cmap[d[dim_y]][d[dim_x]] = c;
+    m = world.cur_map;
+    world.pc_turns++;
 
-    if (p) {
-      pathfind(world.cur_map);
+    cmap_set(m, world.pc.pos[dim_x], world.pc.pos[dim_y], CHAR_NONE);
+    if (d[dim_x] == 0 || d[dim_x] == MAP_X - 1 ||
+        d[dim_y] == 0 || d[dim_y] == MAP_Y - 1) {
+      leave_map(d);
+      m = world.cur_map;
+      d[dim_x] = world.pc.pos[dim_x];
+      d[dim_y] = world.pc.pos[dim_y];
     }
+    cmap_set(m, d[dim_x], d[dim_y], CHAR_PC);
 
-    c->next_turn += move_cost[n ? n->ctype : char_pc]
-                             [world.cur_map->map[d[dim_y]][d[dim_x]]];
+    pathfind(m);
+    cost = move_cost[char_pc][ter_at(m, d[dim_x], d[dim_y])];
+    world.pc.next_turn += cost;
 
-    c->pos[dim_y] = d[dim_y];
-    c->pos[dim_x] = d[dim_x];
+    world.pc.pos[dim_y] = d[dim_y];
+    world.pc.pos[dim_x] = d[dim_x];
+
+    /* Swimmers watch for the PC where it is now */
+    find_swim_view(m);
+
+    heap_insert(&m->turn, turn_datum(CHAR_PC));
+
+    wake_npcs(m, 0);
+
+    if (world.live) {
+      live_step(cost);
+    }
+  }
 
-    heap_insert(&world.cur_map->turn, c);
+  if (world.live) {
+    pool_wait(&live_pool);
   }
 }
 
+/* bench.cpp and regress.cpp have mains of their own */
+#ifndef POKE327_BENCH
 void usage(char *s)
 {
-  fprintf(stderr, "Usage: %s [-s|--seed <seed>]\n", s);
+  fprintf(stderr, "Usage: %s [-s|--seed <seed>] [-h|--headless]\n"
+          "       [-t|--turns <turns>] [-k|--keys <script>]\n"
+          "       [-l|--live <threads>] [-f|--full]\n"
+          "       [-r|--render <curses|ansi|memory>]\n", s);
 
   exit(1);
 }
 
+static double elapsed(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((now.tv_sec - start->tv_sec) +
+          (now.tv_nsec - start->tv_nsec) / 1000000000.0);
+}
+
+static void print_throughput(double secs)
+{
+  printf("%llu PC turns, %llu NPC moves, %llu map transitions in %.3fs\n",
+         (unsigned long long) world.pc_turns,
+         (unsigned long long) world.npc_moves,
+         (unsigned long long) world.map_changes, secs);
+  printf("%.0f turns/sec, %.0f NPC moves/sec, %.1f map transitions/sec\n",
+         world.pc_turns / secs, world.npc_moves / secs,
+         world.map_changes / secs);
+}
+
 int main(int argc, char *argv[])
 {
   struct timeval tv;
+  struct timespec start;
   uint32_t seed;
   int long_arg;
   int do_seed;
+  int headless;
+  uint32_t turns;
+  uint32_t threads = 0;
+  int full = 0;
+  int render = -1;
+  FILE *script;
   //  char c;
   //  int x, y;
   int i;
 
   do_seed = 1;
+  headless = 0;
+  turns = 0;
+  script = NULL;
   
   if (argc > 1) {
     for (i = 1, long_arg = 0; i < argc; i++, long_arg = 0) {
@@ -1170,6 +1728,64 @@ int main(int argc, char *argv[])
           }
           do_seed = 0;
           break;
+        case 'h':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-headless"))) {
+            usage(argv[0]);
+          }
+          headless = 1;
+          break;
+        case 't':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-turns")) ||
+              argc < ++i + 1 /* No more arguments */ ||
+              !sscanf(argv[i], "%u", &turns) /* Argument is not an integer */) {
+            usage(argv[0]);
+          }
+          break;
+        case 'l':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-live")) ||
+              argc < ++i + 1 /* No more arguments */ ||
+              !sscanf(argv[i], "%u", &threads) /* Argument is not an integer */) {
+            usage(argv[0]);
+          }
+          world.live = 1;
+          break;
+        case 'f':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-full"))) {
+            usage(argv[0]);
+          }
+          full = 1;
+          break;
+        case 'r':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-render")) ||
+              argc < ++i + 1 /* No more arguments */) {
+            usage(argv[0]);
+          }
+          if (!strcmp(argv[i], "curses")) {
+            render = io_render_curses;
+          } else if (!strcmp(argv[i], "ansi")) {
+            render = io_render_ansi;
+          } else if (!strcmp(argv[i], "memory")) {
+            render = io_render_memory;
+          } else {
+            usage(argv[0]);
+          }
+          break;
+        case 'k':
+          if ((!long_arg && argv[i][2]) ||
+              (long_arg && strcmp(argv[i], "-keys")) ||
+              argc < ++i + 1 /* No more arguments */) {
+            usage(argv[0]);
+          }
+          if (!(script = fopen(argv[i], "r"))) {
+            perror(argv[i]);
+            exit(1);
+          }
+          break;
         default:
           usage(argv[0]);
         }
@@ -1188,8 +1804,26 @@ int main(int argc, char *argv[])
 
   printf("Using seed: %u\n", seed);
   srand(seed);
+  world.seed = seed;
+  /* Full fidelity steps everyone exactly, for comparing runs */
+  world.lod = !full;
 
-  io_init_terminal();
+  if (world.live) {
+    /* Zero threads steps the other maps on this one, one by one */
+    pool_init(&live_pool, threads, heap_cache_release);
+  }
+
+  if (headless) {
+    /* With a script, run until it's done unless told otherwise */
+    io_init_headless(script, turns ? turns : script ? UINT32_MAX : 10000);
+  } else {
+    io_init_terminal();
+  }
+
+  /* Headless runs only draw when asked to, which is for measuring it */
+  if (render >= 0) {
+    io_init_render((io_render_t) render);
+  }
   
   init_world();
 
@@ -1256,11 +1890,33 @@ int main(int argc, char *argv[])
 
   */
 
+  prof_init();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   game_loop();
+
+  if (headless) {
+    if (render >= 0) {
+      io_render_report();
+    }
+    print_throughput(elapsed(&start));
+  }
+
+  if (world.live) {
+    pool_destroy(&live_pool);
+  }
   
+  io_reset_terminal();
+
+  /* After the terminal is back to normal, while the maps are still here */
+  profile_report();
+
   delete_world();
 
-  io_reset_terminal();
+  if (script) {
+    fclose(script);
+  }
   
   return 0;
 }
+#endif
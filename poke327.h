@@ -3,10 +3,12 @@
 
 # include <cstdlib>
 # include <cassert>
+# include <climits>
 
 # include "heap.h"
 # include "character.h"
 # include "pair.h"
+# include "bitboard.h"
 
 #define malloc(size) ({                 \
   char *_tmp;                           \
@@ -32,9 +34,19 @@
 #define BOULDER_PROB       95
 #define WORLD_SIZE         401
 
+#if MAP_X > ROW_BITS || MAP_X & 1
+# error "Rows must fit in a row_t and pack evenly into nibbles"
+#endif
+
+/* Columns that characters may occupy; the border is off limits */
+#define ROW_INTERIOR row_span(1, MAP_X - 2)
+
 #define MIN_TRAINERS     7
 #define ADD_TRAINER_PROB 60
 
+/* Dormant NPCs wake when the PC comes this close or into view */
+#define NPC_WAKE_DIST    8
+
 #define MOUNTAIN_SYMBOL       '%'
 #define BOULDER_SYMBOL        '0'
 #define TREE_SYMBOL           '4'
@@ -58,11 +70,6 @@
 #define SWIMMER_SYMBOL  'm'
 #define WANDERER_SYMBOL 'w'
 
-#define mappair(pair) (m->map[pair[dim_y]][pair[dim_x]])
-#define mapxy(x, y) (m->map[y][x])
-#define heightpair(pair) (m->height[pair[dim_y]][pair[dim_x]])
-#define heightxy(x, y) (m->height[y][x])
-
 typedef enum __attribute__ ((__packed__)) terrain_type {
   ter_boulder,
   ter_tree,
@@ -80,16 +87,133 @@ typedef enum __attribute__ ((__packed__)) terrain_type {
   ter_debug
 } terrain_type_t;
 
+/* Terrain classes are sets of terrain types, one bit per type */
+# define ter_mask(t) (1U << (t))
+
 extern int32_t move_cost[num_character_types][num_terrain_types];
 
+/* Movement classes labeled for connectivity.  Swimmers are confined to *
+ * water and bridges, which move_cost alone doesn't capture.  Trainers  *
+ * only ever ask what they can reach from the PC, which flood_fill()    *
+ * answers from wherever the PC stands, so they have no labels.         */
+typedef enum region_class {
+  region_pc,
+  region_swim,
+  num_region_classes
+} region_class_t;
+
+/* Terrain classes movers ask about a cell's neighbors, kept per map */
+typedef enum __attribute__ ((__packed__)) nbr_class {
+  nbr_water,
+  nbr_pace,
+  nbr_explore,
+  num_nbr_classes
+} nbr_class_t;
+
+extern const uint32_t nbr_class[num_nbr_classes];
+
+/* True if terrain t is in neighborhood class k.  Explorers may go *
+ * wherever move_cost lets them, so their class is read from there, *
+ * the same way pass[] is, rather than kept as a list of its own.   */
+static inline bool nbr_in(nbr_class_t k, terrain_type_t t)
+{
+  return (k == nbr_explore ?
+          move_cost[char_other][t] != DIJKSTRA_PATH_MAX :
+          (nbr_class[k] >> t) & 1);
+}
+
+/* Places the PC may want to get to; see map::facility */
+typedef enum __attribute__ ((__packed__)) facility {
+  fac_mart,
+  fac_center,
+  num_facilities
+} facility_t;
+
+/* A facility distance for cells that can't get to one.  Real distances *
+ * fit well below it: even a path through every interior cell at the    *
+ * PC's dearest finite move_cost comes to under 30,000.                 */
+# define FACILITY_FAR UINT16_MAX
+
+/* The sides of a map, where its gates are */
+typedef enum __attribute__ ((__packed__)) gate_side {
+  gate_n,
+  gate_e,
+  gate_s,
+  gate_w,
+  num_gate_sides
+} gate_side_t;
+
+/* Most NPCs a map can hold: one on every interior cell */
+#define NPC_MAX ((MAP_X - 2) * (MAP_Y - 2))
+
+/* A map's NPCs, one array per field so that stepping through them walks *
+ * contiguous memory.  Indexed directly by handle, so the first         *
+ * NPC_FIRST entries go unused.  NPCs never leave their map, so handles *
+ * are simply handed out in order, and once the map is populated the    *
+ * arrays are cut down to fit.  All of them share one block, which hn   *
+ * starts.  hn is the NPC's turn queue node, NULL while it's out of the *
+ * queue taking its turn or dormant.                                    */
+typedef struct npc_store {
+  char_id_t count;
+  /* Room for this many NPCs */
+  char_id_t cap;
+  heap_node_t **hn;
+  int32_t *next_turn;
+  int32_t *seq_num;
+  pair_t *pos;
+  pair_t *dir;
+  character_type_t *ctype;
+  movement_type_t *mtype;
+  uint8_t *defeated;
+  uint8_t *dormant;
+  char *symbol;
+} npc_store_t;
+
 class map {
  public:
-  terrain_type_t map[MAP_Y][MAP_X];
-  uint8_t height[MAP_Y][MAP_X];
-  character *cmap[MAP_Y][MAP_X];
+  /* Terrain is stored twice: packed four bits to a cell for point lookups, *
+   * and as one bitboard per terrain type for neighborhood and class       *
+   * queries.  Use the ter_*() functions below rather than touching either *
+   * directly; ter_set() is the only thing that may change them.           */
+  uint8_t ter[MAP_Y][MAP_X / 2];
+  row_t ter_bits[num_terrain_types][MAP_Y];
+  /* Cells each character type can enter, per move_cost */
+  row_t pass[num_character_types][MAP_Y];
+  /* Bit i of nbr[k][y][x] is set if the neighbor of (x, y) toward *
+   * all_dirs[i] is in neighborhood class k.  Kept by ter_set().   */
+  uint8_t nbr[num_nbr_classes][MAP_Y][MAP_X];
+  /* Connected interior regions per movement class, numbered from 1.  *
+   * Zero means a character of that class can't stand there.  Labeled *
+   * once when the map is generated; ter_set() does not update them.  */
+  uint16_t region[num_region_classes][MAP_Y][MAP_X];
+  /* What it costs the PC to walk from each cell to the nearest mart or *
+   * center, or FACILITY_FAR if it can't get to one.  Buildings never   *
+   * move, so these are worked out once, with the map.  Read them with  *
+   * facility_dist().                                                   */
+  uint16_t facility[num_facilities][MAP_Y][MAP_X];
+  /* Change cmap through cmap_set(), which lets the display know */
+  char_id_t cmap[MAP_Y][MAP_X];
+  /* Cells changed since the display last looked, whether terrain or *
+   * characters.  Marked by ter_set() and cmap_set().                 */
+  row_t dirty[MAP_Y];
+  npc_store_t npc;
+  /* Where the dormant NPCs are; they don't move, so this stays put */
+  row_t dormant[MAP_Y];
   heap_t turn;
+  /* The turn queue's work, in profiling builds; see prof.h */
+  heap_stats_t turn_stats;
   int32_t num_trainers;
   int8_t n, s, e, w;
+  /* What it costs the PC to walk from just inside one gate to just   *
+   * inside another, by gate_side_t.  Worked out by the router the    *
+   * first time a route crosses the map; nonzero gate_cost_known says *
+   * it has been.                                                     */
+  int32_t gate_cost[num_gate_sides][num_gate_sides];
+  int gate_cost_known;
+  /* For simulating the map while the PC is elsewhere: the turn the map *
+   * has been run up to, and its own random number stream.             */
+  int32_t clock;
+  unsigned rng;
 };
 
 class world {
@@ -101,10 +225,25 @@ class world {
    * we only need one pair at any given time.      */
   int hiker_dist[MAP_Y][MAP_X];
   int rival_dist[MAP_Y][MAP_X];
+  /* Cells from which a swimmer would notice the PC, redone every PC move */
+  row_t swim_view[MAP_Y];
   class pc pc;
   int quit;
   int add_trainer_prob;
   int char_seq_num;
+  /* Every map generated so far, in order */
+  map **resident;
+  uint32_t num_resident;
+  /* Nonzero to keep simulating maps the PC isn't on */
+  int live;
+  /* Nonzero to let NPCs on maps the PC isn't on move in coarse *
+   * multi-step runs                                             */
+  int lod;
+  uint32_t seed;
+  /* Simulation counters, reported at the end of headless runs */
+  uint64_t pc_turns;
+  uint64_t npc_moves;
+  uint64_t map_changes;
 };
 
 /* Even unallocated, a WORLD_SIZE x WORLD_SIZE array of pointers is a very *
@@ -119,6 +258,160 @@ extern pair_t all_dirs[8];
   dir[1] = all_dirs[_i][1]; \
 }
 
+static inline terrain_type_t ter_at(const map *m, int16_t x, int16_t y)
+{
+  return (terrain_type_t) ((m->ter[y][x >> 1] >> ((x & 1) << 2)) & 0xf);
+}
+
+static inline bool ter_is(const map *m, int16_t x, int16_t y,
+                          terrain_type_t t)
+{
+  return row_test(m->ter_bits[t][y], x);
+}
+
+/* True if the terrain at (x, y) is in class, a set of ter_mask()s */
+static inline bool ter_in(const map *m, int16_t x, int16_t y, uint32_t cls)
+{
+  return (cls >> ter_at(m, x, y)) & 1;
+}
+
+/* All cells of row y whose terrain is in class */
+static inline row_t ter_row(const map *m, uint32_t cls, int16_t y)
+{
+  row_t r;
+  int t;
+
+  for (r = 0, t = 0; t < num_terrain_types; t++) {
+    if (cls & ter_mask(t)) {
+      r |= m->ter_bits[t][y];
+    }
+  }
+
+  return r;
+}
+
+/* Index into all_dirs of the direction (dx, dy) */
+# define dir_index(dx, dy) ((((dx) + 1) * 3 + (dy) + 1) -                 \
+                            (((dx) + 1) * 3 + (dy) + 1 > 4))
+
+/* All eight neighbors of (x, y) in class k, as a bitmask over all_dirs.   *
+ * (x, y) must not be on the border.                                      */
+static inline uint8_t nbr_mask(const map *m, nbr_class_t k,
+                               int16_t x, int16_t y)
+{
+  return m->nbr[k][y][x];
+}
+
+/* True if the neighbor of (x, y) in direction dir is in class k */
+static inline bool nbr_is(const map *m, nbr_class_t k,
+                          int16_t x, int16_t y, const int16_t *dir)
+{
+  return (m->nbr[k][y][x] >> dir_index(dir[0], dir[1])) & 1;
+}
+
+static inline void ter_set(map *m, int16_t x, int16_t y, terrain_type_t t)
+{
+  int16_t nx, ny;
+  int c, i, k;
+
+  m->ter_bits[ter_at(m, x, y)][y] &= ~row_bit(x);
+  m->ter[y][x >> 1] &= ~(0xf << ((x & 1) << 2));
+  m->ter[y][x >> 1] |= t << ((x & 1) << 2);
+  m->ter_bits[t][y] |= row_bit(x);
+  m->dirty[y] |= row_bit(x);
+
+  for (c = 0; c < num_character_types; c++) {
+    if (move_cost[c][t] == DIJKSTRA_PATH_MAX) {
+      m->pass[c][y] &= ~row_bit(x);
+    } else {
+      m->pass[c][y] |= row_bit(x);
+    }
+  }
+
+  /* (x, y) is its neighbor's neighbor in the opposite direction, 7 - i */
+  for (i = 0; i < 8; i++) {
+    nx = x + all_dirs[i][0];
+    ny = y + all_dirs[i][1];
+    if (nx < 0 || nx >= MAP_X || ny < 0 || ny >= MAP_Y) {
+      continue;
+    }
+    for (k = 0; k < num_nbr_classes; k++) {
+      if (nbr_in((nbr_class_t) k, t)) {
+        m->nbr[k][ny][nx] |= 1 << (7 - i);
+      } else {
+        m->nbr[k][ny][nx] &= ~(1 << (7 - i));
+      }
+    }
+  }
+}
+
+static inline void cmap_set(map *m, int16_t x, int16_t y, char_id_t c)
+{
+  m->cmap[y][x] = c;
+  m->dirty[y] |= row_bit(x);
+}
+
+static inline uint16_t region_at(const map *m, region_class_t k,
+                                 int16_t x, int16_t y)
+{
+  return m->region[k][y][x];
+}
+
+/* The facility distance at (x, y), or DIJKSTRA_PATH_MAX if there's none */
+static inline int facility_dist(const map *m, facility_t f,
+                                int16_t x, int16_t y)
+{
+  return (m->facility[f][y][x] == FACILITY_FAR ?
+          DIJKSTRA_PATH_MAX : m->facility[f][y][x]);
+}
+
+/* Everything NPC movement needs to know about the map being stepped.  *
+ * On the PC's map, that's where the PC is and the distance maps to it; *
+ * maps stepped while the PC is elsewhere get NULLs there and use their *
+ * own random number stream, so that any thread can run them.          */
+struct sim {
+  map *m;
+  const int16_t *pc;
+  int (*hiker_dist)[MAP_X];
+  int (*rival_dist)[MAP_X];
+  const row_t *swim_view;
+  unsigned *rng;
+  /* NPCs due before this time may move; the PC's turn, or the map's clock */
+  int32_t until;
+  int lod;
+  uint64_t npc_moves;
+};
+
+static inline int sim_rand(sim_t *s)
+{
+  return s->rng ? rand_r(s->rng) : rand();
+}
+
+#define sim_rand_dir(s, dir) {     \
+  int _i = sim_rand(s) & 0x7;      \
+  dir[0] = all_dirs[_i][0];        \
+  dir[1] = all_dirs[_i][1];        \
+}
+
+/* The map whose turn queue this thread is working on, if not the PC's */
+extern thread_local map *turn_map;
+
+static inline bool is_npc(char_id_t c)
+{
+  return c >= NPC_FIRST;
+}
+
+/* Position and symbol of any character on m, PC or not */
+static inline int16_t *char_pos(map *m, char_id_t c)
+{
+  return c == CHAR_PC ? world.pc.pos : m->npc.pos[c];
+}
+
+static inline char char_symbol(const map *m, char_id_t c)
+{
+  return c == CHAR_PC ? world.pc.symbol : m->npc.symbol[c];
+}
+
 typedef struct path {
   heap_node_t *hn;
   uint8_t pos[2];
@@ -126,7 +419,27 @@ typedef struct path {
   int32_t cost;
 } path_t;
 
+void init_world();
+void delete_world();
+void game_loop();
 int new_map(int teleport);
 void pathfind(map *m);
+void pc_dist_to_cells(const map *m, const row_t target[MAP_Y],
+                      int dist[MAP_Y][MAP_X]);
+void pc_dist_to(const map *m, uint32_t cls, int dist[MAP_Y][MAP_X]);
+uint32_t can_see(map *m, const pair_t voyeur, const pair_t exhibitionist,
+                 uint32_t clear);
+void shadowcast(map *m, const pair_t o, uint32_t clear, row_t seen[MAP_Y]);
+void find_swim_view(map *m);
+void flood_fill(const row_t pass[MAP_Y], int16_t x, int16_t y,
+                row_t reach[MAP_Y]);
+uint16_t gate_region(const map *m, region_class_t k);
+int teleport_pos(const map *m, pair_t pos);
+void npc_schedule(map *m, char_id_t c);
+void npc_sleep(map *m, char_id_t c);
+void wake_npcs(map *m, int all);
+# ifdef POKE327_BENCH
+void bench_dijkstra_path(pair_t from, pair_t to);
+# endif
 
 #endif
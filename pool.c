@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "pool.h"
+
+static void *pool_worker(void *v)
+{
+  pool_t *p = (pool_t *) v;
+  uint32_t batch, i;
+
+  /* Batches start at one, so even a thread that starts late sees the first */
+  pthread_mutex_lock(&p->lock);
+  for (batch = 0; ; ) {
+    while (!p->quit && batch == p->batch) {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->quit) {
+      break;
+    }
+    batch = p->batch;
+    while (p->next < p->count) {
+      i = p->next++;
+      pthread_mutex_unlock(&p->lock);
+      p->task(p->arg, i);
+      pthread_mutex_lock(&p->lock);
+      if (++p->finished == p->count) {
+        pthread_cond_signal(&p->done);
+      }
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  /* Anything the tasks cached per thread goes with the thread */
+  if (p->thread_exit) {
+    p->thread_exit();
+  }
+
+  return NULL;
+}
+
+void pool_init(pool_t *p, uint32_t num_threads, void (*thread_exit)(void))
+{
+  uint32_t i;
+
+  p->num_threads = num_threads;
+  p->batch = 0;
+  p->task = NULL;
+  p->arg = NULL;
+  p->count = p->next = p->finished = 0;
+  p->quit = 0;
+  p->thread_exit = thread_exit;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  assert((p->threads = calloc(num_threads ? num_threads : 1,
+                              sizeof (*p->threads))));
+  for (i = 0; i < num_threads; i++) {
+    assert(!pthread_create(&p->threads[i], NULL, pool_worker, p));
+  }
+}
+
+void pool_destroy(pool_t *p)
+{
+  uint32_t i;
+
+  pool_wait(p);
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < p->num_threads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  free(p->threads);
+
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+}
+
+void pool_run(pool_t *p, void (*task)(void *arg, uint32_t i), void *arg,
+              uint32_t count)
+{
+  uint32_t i;
+
+  if (!p->num_threads) {
+    for (i = 0; i < count; i++) {
+      task(arg, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->task = task;
+  p->arg = arg;
+  p->count = count;
+  p->next = p->finished = 0;
+  p->batch++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void pool_wait(pool_t *p)
+{
+  pthread_mutex_lock(&p->lock);
+  while (p->finished < p->count) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+# define POOL_H
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+# include <stdint.h>
+# include <pthread.h>
+
+/* A fixed set of worker threads that run batches of independent tasks. *
+ * pool_run() hands out task indices 0 through count - 1, each exactly  *
+ * once, to whichever worker is free, and returns without waiting.      *
+ * pool_wait() blocks until the whole batch is done.  With no threads,  *
+ * pool_run() simply runs the batch itself.                             */
+typedef struct pool {
+  pthread_t *threads;
+  uint32_t num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint32_t batch;
+  void (*task)(void *arg, uint32_t i);
+  void *arg;
+  uint32_t count;
+  uint32_t next;
+  uint32_t finished;
+  int quit;
+  void (*thread_exit)(void);
+} pool_t;
+
+void pool_init(pool_t *p, uint32_t num_threads, void (*thread_exit)(void));
+void pool_destroy(pool_t *p);
+void pool_run(pool_t *p, void (*task)(void *arg, uint32_t i), void *arg,
+              uint32_t count);
+void pool_wait(pool_t *p);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif
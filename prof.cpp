@@ -0,0 +1,173 @@
+#include "prof.h"
+
+#ifdef POKE327_PROFILE
+
+# include <cstdio>
+# include <csignal>
+# include <ctime>
+
+/* Times are kept in log-linear buckets: exact below 8ns, then eight *
+ * buckets to every power of two, so a percentile read back is never *
+ * more than 12.5% off, and recording one is a few instructions.     */
+# define PROF_SUB_BITS 3
+# define PROF_SUB (1 << PROF_SUB_BITS)
+# define PROF_BUCKETS ((64 - PROF_SUB_BITS + 1) * PROF_SUB)
+
+typedef struct prof_hist {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint64_t bucket[PROF_BUCKETS];
+} prof_hist_t;
+
+static const char *prof_name[num_prof_phases] = {
+  "new_map",
+  "smooth_height",
+  "map_terrain",
+  "place_boulders",
+  "place_trees",
+  "build_paths",
+  "place_buildings",
+  "label_regions",
+  "find_facilities",
+  "place_characters",
+  "pathfind",
+  "io_display",
+};
+
+static const char *prof_heap_name[num_prof_heaps] = {
+  "turn queues",
+  "pathfind",
+  "pc_dist_to",
+  "dijkstra_path",
+  "world_route",
+};
+
+static prof_hist_t prof_hist[num_prof_phases];
+static heap_stats_t prof_heaps[num_prof_heaps];
+static volatile sig_atomic_t prof_signaled;
+
+uint64_t prof_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint32_t prof_bucket(uint64_t ns)
+{
+  uint32_t e;
+
+  if (ns < PROF_SUB) {
+    return ns;
+  }
+
+  e = 63 - __builtin_clzll(ns);
+
+  return ((e - PROF_SUB_BITS + 1) * PROF_SUB +
+          ((ns >> (e - PROF_SUB_BITS)) & (PROF_SUB - 1)));
+}
+
+/* The middle of the times that fall in bucket b */
+static uint64_t prof_bucket_ns(uint32_t b)
+{
+  uint32_t e;
+
+  if (b < PROF_SUB) {
+    return b;
+  }
+
+  e = b / PROF_SUB + PROF_SUB_BITS - 1;
+
+  return (((uint64_t) (PROF_SUB + b % PROF_SUB) << (e - PROF_SUB_BITS)) +
+          ((1ULL << (e - PROF_SUB_BITS)) >> 1));
+}
+
+void prof_record(prof_phase_t p, uint64_t ns)
+{
+  prof_hist_t *h = prof_hist + p;
+
+  h->count++;
+  h->total += ns;
+  if (ns > h->max) {
+    h->max = ns;
+  }
+  h->bucket[prof_bucket(ns)]++;
+}
+
+/* The time below which a fraction q of the phase's samples fall */
+static uint64_t prof_percentile(const prof_hist_t *h, double q)
+{
+  uint64_t want, seen;
+  uint32_t b;
+
+  want = (uint64_t) (q * h->count + 0.999999);
+  for (seen = 0, b = 0; b < PROF_BUCKETS; b++) {
+    if ((seen += h->bucket[b]) >= want) {
+      break;
+    }
+  }
+
+  /* The top bucket is wider than anything actually seen in it */
+  return prof_bucket_ns(b) < h->max ? prof_bucket_ns(b) : h->max;
+}
+
+heap_stats_t *prof_heap(prof_heap_t which)
+{
+  return prof_heaps + which;
+}
+
+static void prof_signal(int sig)
+{
+  prof_signaled = 1;
+}
+
+void prof_init(void)
+{
+  signal(SIGUSR1, prof_signal);
+}
+
+/* True once after each SIGUSR1, for the caller to report from *
+ * somewhere safe.                                              */
+int prof_poll(void)
+{
+  if (prof_signaled) {
+    prof_signaled = 0;
+    return 1;
+  }
+
+  return 0;
+}
+
+void prof_report(uint64_t turns)
+{
+  const prof_hist_t *h;
+  int32_t p;
+
+  fprintf(stderr, "%-17s %8s %10s %10s %10s %12s\n",
+          "phase", "calls", "p50 us", "p99 us", "max us", "total ms");
+  for (p = 0; p < num_prof_phases; p++) {
+    h = prof_hist + p;
+    if (!h->count) {
+      continue;
+    }
+    fprintf(stderr, "%-17s %8llu %10.1f %10.1f %10.1f %12.1f\n",
+            prof_name[p], (unsigned long long) h->count,
+            prof_percentile(h, 0.5) / 1000.0,
+            prof_percentile(h, 0.99) / 1000.0,
+            h->max / 1000.0, h->total / 1000000.0);
+  }
+
+  fprintf(stderr, "\n%-17s %9s %9s %9s %9s %9s %9s %9s %6s %8s\n",
+          "heap, per turn", "insert", "rm_min", "decr_key", "consol",
+          "links", "cuts", "cascades", "roots", "size");
+  for (p = 0; p < num_prof_heaps; p++) {
+    if (prof_heaps[p].inserts) {
+      heap_stats_print(stderr, prof_heap_name[p], prof_heaps + p, turns);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef PROF_H
+# define PROF_H
+
+# include <cstdint>
+
+# include "heap.h"
+
+/* Phases timed when built with PROFILE=1, which defines POKE327_PROFILE. *
+ * Put PROF_SCOPE(phase) at the top of a block and the time until the     *
+ * block is left goes into that phase's histogram.  prof_report() prints  *
+ * them all to stderr, at exit and whenever SIGUSR1 comes in.  Otherwise  *
+ * all of this compiles away to nothing.  Only the main thread times      *
+ * anything, so none of it is locked.                                     *
+ *                                                                        *
+ * The heaps below also keep heap_stats_t, attached with PROF_HEAP(), and *
+ * the report gives their work per PC turn.                               */
+typedef enum prof_phase {
+  prof_new_map,
+  prof_smooth_height,
+  prof_map_terrain,
+  prof_place_boulders,
+  prof_place_trees,
+  prof_build_paths,
+  prof_place_buildings,
+  prof_label_regions,
+  prof_find_facilities,
+  prof_place_characters,
+  prof_pathfind,
+  prof_io_display,
+  num_prof_phases
+} prof_phase_t;
+
+typedef enum prof_heap {
+  prof_heap_turn,
+  prof_heap_pathfind,
+  prof_heap_dist,
+  prof_heap_paths,
+  prof_heap_route,
+  num_prof_heaps
+} prof_heap_t;
+
+# ifdef POKE327_PROFILE
+
+uint64_t prof_now(void);
+void prof_record(prof_phase_t p, uint64_t ns);
+heap_stats_t *prof_heap(prof_heap_t which);
+void prof_init(void);
+int prof_poll(void);
+void prof_report(uint64_t turns);
+
+class prof_scope {
+ public:
+  prof_scope(prof_phase_t p) : phase(p), start(prof_now()) {}
+  ~prof_scope() { prof_record(phase, prof_now() - start); }
+ private:
+  prof_phase_t phase;
+  uint64_t start;
+};
+
+#  define PROF_JOIN(a, b) a ## b
+#  define PROF_NAME(line) PROF_JOIN(prof_scope_, line)
+#  define PROF_SCOPE(p) prof_scope PROF_NAME(__LINE__)(p)
+#  define PROF_HEAP(h, s) heap_stats_attach(h, s)
+
+# else
+
+#  define PROF_SCOPE(p)
+#  define PROF_HEAP(h, s)
+
+static inline void prof_init(void) {}
+static inline int prof_poll(void) { return 0; }
+static inline void prof_report(uint64_t turns) {}
+
+# endif
+
+#endif
@@ -0,0 +1,569 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "heap.h"
+#include "poke327.h"
+#include "character.h"
+#include "io.h"
+#include "pool.h"
+
+/* Performance regression checks against golden seeds, run by make      *
+ * regress.  For each seed in the baseline file, this generates a fixed *
+ * set of maps, then plays the game headless from that seed for the     *
+ * given number of turns, just as poke327 -h -s <seed> -t <turns>       *
+ * would, and hashes what came of it: the terrain of every map, where   *
+ * every character is, and the distance fields.  The hashes must match  *
+ * the baseline exactly.  The times, the fastest of a few runs, are     *
+ * compared with it too, and unless -n is given must come out, over     *
+ * all the seeds, no slower than the tolerance allows.  They're only    *
+ * worth holding to on the machine that wrote the baseline, so make     *
+ * regress passes -n and make regress-times doesn't.  Held to both, a   *
+ * change meant to make the game faster, not different, is proven both  *
+ * ways.                                                                *
+ *                                                                      *
+ * Each run is made in a process of its own, forked for it, since the   *
+ * game keeps state in globals and statics that nothing resets.  -u     *
+ * rewrites the baseline from this build, for when a change of behavior *
+ * is intended, or for a new machine.                                   *
+ *                                                                      *
+ * Before the seeds, the message ring is checked from several threads   *
+ * at once, which nothing in a headless game does.                      */
+
+#define REGRESS_REPS 5
+#define REGRESS_TURNS 500
+#define REGRESS_TOLERANCE 10.0
+#define REGRESS_MAX_SEEDS 64
+#define REGRESS_RING_THREADS 4
+#define REGRESS_RING_MESSAGES 20000
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef enum regress_hash {
+  regress_terrain,
+  regress_chars,
+  regress_dist,
+  num_regress_hashes
+} regress_hash_t;
+
+static const char *regress_hash_name[num_regress_hashes] = {
+  "terrain",
+  "chars",
+  "dist",
+};
+
+/* Maps generated before play, as offsets from the center; the last is *
+ * far enough out that buildings are rare.                             */
+static const int16_t regress_maps[][2] = {
+  {  0,  0 }, {  1,  0 }, {  1,  1 }, {  0,  1 }, { -1,  1 },
+  { -1,  0 }, { -1, -1 }, {  0, -1 }, {  1, -1 }, { 150, -150 },
+};
+
+typedef struct regress_result {
+  uint64_t hash[num_regress_hashes];
+  /* Nanoseconds spent generating and playing */
+  uint64_t gen, play;
+} regress_result_t;
+
+typedef struct regress_seed {
+  uint32_t seed;
+  uint32_t turns;
+  regress_result_t r;
+} regress_seed_t;
+
+static const char *regress_script;
+
+static uint64_t regress_now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* FNV-1a, carried on from h */
+static uint64_t regress_fnv(uint64_t h, const void *v, size_t n)
+{
+  const uint8_t *p = (const uint8_t *) v;
+
+  while (n--) {
+    h = (h ^ *p++) * FNV_PRIME;
+  }
+
+  return h;
+}
+
+#define regress_add(r, which, v) \
+  ((r)->hash[which] = regress_fnv((r)->hash[which], &(v), sizeof (v)))
+
+/* Adds every map in the world to r's hashes, in the world's order, and *
+ * the PC and the distance maps it last had worked out.                 */
+static void regress_hash_world(regress_result_t *r)
+{
+  int16_t x, y, i, j;
+  terrain_type_t t;
+  char_id_t c;
+  map *m;
+
+  for (y = 0; y < WORLD_SIZE; y++) {
+    for (x = 0; x < WORLD_SIZE; x++) {
+      if (!(m = world.world[y][x])) {
+        continue;
+      }
+
+      regress_add(r, regress_terrain, x);
+      regress_add(r, regress_terrain, y);
+      for (j = 0; j < MAP_Y; j++) {
+        for (i = 0; i < MAP_X; i++) {
+          t = ter_at(m, i, j);
+          regress_add(r, regress_terrain, t);
+        }
+      }
+      regress_add(r, regress_terrain, m->n);
+      regress_add(r, regress_terrain, m->s);
+      regress_add(r, regress_terrain, m->e);
+      regress_add(r, regress_terrain, m->w);
+
+      regress_add(r, regress_chars, m->npc.count);
+      for (c = NPC_FIRST; c < NPC_FIRST + m->npc.count; c++) {
+        regress_add(r, regress_chars, m->npc.pos[c]);
+        regress_add(r, regress_chars, m->npc.ctype[c]);
+        regress_add(r, regress_chars, m->npc.defeated[c]);
+      }
+
+      regress_add(r, regress_dist, m->facility);
+    }
+  }
+
+  regress_add(r, regress_chars, world.cur_idx);
+  regress_add(r, regress_chars, world.pc.pos);
+  regress_add(r, regress_dist, world.hiker_dist);
+  regress_add(r, regress_dist, world.rival_dist);
+}
+
+static void regress_start(uint32_t seed)
+{
+  srand(seed);
+  world.seed = seed;
+  world.lod = 1;
+}
+
+static void regress_gen(const regress_seed_t *s, regress_result_t *r)
+{
+  uint32_t i;
+
+  regress_start(s->seed);
+  r->gen = regress_now();
+  init_world();
+  for (i = 1; i < sizeof (regress_maps) / sizeof (regress_maps[0]); i++) {
+    world.cur_idx[dim_x] = WORLD_SIZE / 2 + regress_maps[i][dim_x];
+    world.cur_idx[dim_y] = WORLD_SIZE / 2 + regress_maps[i][dim_y];
+    new_map(0);
+  }
+  pathfind(world.cur_map);
+  r->gen = regress_now() - r->gen;
+
+  regress_hash_world(r);
+}
+
+static void regress_play(const regress_seed_t *s, regress_result_t *r)
+{
+  FILE *script = NULL;
+
+  if (regress_script && !(script = fopen(regress_script, "r"))) {
+    perror(regress_script);
+    exit(1);
+  }
+
+  regress_start(s->seed);
+  io_init_headless(script, s->turns);
+  init_world();
+  r->play = regress_now();
+  game_loop();
+  r->play = regress_now() - r->play;
+
+  regress_hash_world(r);
+  regress_add(r, regress_chars, world.pc_turns);
+  regress_add(r, regress_chars, world.npc_moves);
+  regress_add(r, regress_chars, world.map_changes);
+}
+
+/* Runs f in a fresh child, to start from the state the game starts in, *
+ * and brings back the result it leaves in r.                           */
+static void regress_fork(void (*f)(const regress_seed_t *, regress_result_t *),
+                         const regress_seed_t *s, regress_result_t *r)
+{
+  int fd[2], status;
+  ssize_t n;
+  pid_t pid;
+
+  fflush(stdout);
+  fflush(stderr);
+  if (pipe(fd) || (pid = fork()) < 0) {
+    perror("regress");
+    exit(1);
+  }
+
+  if (!pid) {
+    close(fd[0]);
+    f(s, r);
+    n = write(fd[1], r, sizeof (*r));
+    _exit(n != sizeof (*r));
+  }
+
+  close(fd[1]);
+  n = read(fd[0], r, sizeof (*r));
+  close(fd[0]);
+  waitpid(pid, &status, 0);
+  if (n != sizeof (*r) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "Seed %u: run failed\n", s->seed);
+    exit(1);
+  }
+}
+
+/* The hashes, and the fastest of reps runs */
+static void regress_run(regress_seed_t *s, uint32_t reps)
+{
+  regress_result_t r;
+  uint32_t i, j;
+
+  for (i = 0; i < reps; i++) {
+    /* Play carries on the hashes generation started */
+    for (j = 0; j < num_regress_hashes; j++) {
+      r.hash[j] = FNV_OFFSET;
+    }
+    regress_fork(regress_gen, s, &r);
+    regress_fork(regress_play, s, &r);
+
+    if (!i || r.gen < s->r.gen) {
+      s->r.gen = r.gen;
+    }
+    if (!i || r.play < s->r.play) {
+      s->r.play = r.play;
+    }
+    if (i && memcmp(r.hash, s->r.hash, sizeof (r.hash))) {
+      fprintf(stderr, "Seed %u: runs differ from each other\n", s->seed);
+      exit(1);
+    }
+    memcpy(s->r.hash, r.hash, sizeof (r.hash));
+  }
+}
+
+/* Reads the baseline; returns the number of seeds, or -1 without a file */
+static int32_t regress_load(const char *path, regress_seed_t *base)
+{
+  unsigned long long h[num_regress_hashes];
+  double gen, play;
+  char line[256];
+  int32_t n;
+  FILE *f;
+
+  if (!(f = fopen(path, "r"))) {
+    return -1;
+  }
+
+  n = 0;
+  while (fgets(line, sizeof (line), f) && n < REGRESS_MAX_SEEDS) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    if (sscanf(line, "%u %u %llx %llx %llx %lf %lf",
+               &base[n].seed, &base[n].turns, h, h + 1, h + 2,
+               &gen, &play) != 7) {
+      fprintf(stderr, "%s: can't read \"%s\"\n", path, strtok(line, "\n"));
+      exit(1);
+    }
+    memcpy(base[n].r.hash, h, sizeof (base[n].r.hash));
+    base[n].r.gen = gen * 1000000;
+    base[n].r.play = play * 1000000;
+    n++;
+  }
+  fclose(f);
+
+  return n;
+}
+
+static void regress_save(const char *path, const regress_seed_t *s, int32_t n)
+{
+  int32_t i;
+  FILE *f;
+
+  if (!(f = fopen(path, "w"))) {
+    perror(path);
+    exit(1);
+  }
+
+  fprintf(f, "# Golden seeds for make regress; rewrite with "
+          "poke327_regress -u %s\n"
+          "# seed turns terrain chars dist gen_ms play_ms\n", path);
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%u %u %016llx %016llx %016llx %.3f %.3f\n",
+            s[i].seed, s[i].turns,
+            (unsigned long long) s[i].r.hash[regress_terrain],
+            (unsigned long long) s[i].r.hash[regress_chars],
+            (unsigned long long) s[i].r.hash[regress_dist],
+            s[i].r.gen / 1000000.0, s[i].r.play / 1000000.0);
+  }
+
+  fclose(f);
+}
+
+static uint32_t regress_ring_done;
+
+static void regress_ring_task(void *arg, uint32_t i)
+{
+  uint32_t k;
+
+  for (k = 0; k < REGRESS_RING_MESSAGES; k++) {
+    io_queue_message("ring %u %u", i, k);
+    /* Let the reader in now and then, even on one core */
+    if (!(k % 16)) {
+      sched_yield();
+    }
+  }
+
+  __atomic_fetch_add(&regress_ring_done, 1, __ATOMIC_RELEASE);
+}
+
+/* Queues messages from several threads while this one takes them.  Each *
+ * must come out whole, no more than once and in the order its thread    *
+ * queued it, and every one that doesn't come out must have been counted *
+ * as dropped.  Returns nonzero if any of that fails.                    */
+static int regress_ring(void)
+{
+  char msg[IO_MESSAGE_LEN], want[IO_MESSAGE_LEN];
+  int64_t last[REGRESS_RING_THREADS];
+  uint32_t i, k, taken, done;
+  int bad;
+  pool_t p;
+
+  for (i = 0; i < REGRESS_RING_THREADS; i++) {
+    last[i] = -1;
+  }
+
+  pool_init(&p, REGRESS_RING_THREADS, NULL);
+  pool_run(&p, regress_ring_task, NULL, REGRESS_RING_THREADS);
+
+  /* One last look after the writers are done picks up the stragglers */
+  for (bad = 0, taken = 0; ; ) {
+    done = (__atomic_load_n(&regress_ring_done, __ATOMIC_ACQUIRE) ==
+            REGRESS_RING_THREADS);
+    while (io_take_message(msg)) {
+      taken++;
+      if (sscanf(msg, "ring %u %u", &i, &k) != 2 ||
+          i >= REGRESS_RING_THREADS || k <= last[i]) {
+        bad = 1;
+        continue;
+      }
+      snprintf(want, sizeof (want), "ring %u %u", i, k);
+      bad |= strcmp(msg, want) != 0;
+      last[i] = k;
+    }
+    if (done) {
+      break;
+    }
+  }
+
+  pool_wait(&p);
+  pool_destroy(&p);
+
+  bad |= (taken + io_dropped_messages() !=
+          REGRESS_RING_THREADS * REGRESS_RING_MESSAGES);
+  printf("Message ring, %u threads: %u queued, %u taken, %u dropped, %s\n",
+         REGRESS_RING_THREADS, REGRESS_RING_THREADS * REGRESS_RING_MESSAGES,
+         taken, io_dropped_messages(), bad ? "BROKEN" : "ok");
+
+  return bad;
+}
+
+/* How a time compares, as a ratio to the baseline's: -1 faster, 0 *
+ * within tolerance, 1 slower.                                      */
+static int regress_time(double ratio, double tolerance)
+{
+  if (ratio > 1 + tolerance / 100) {
+    return 1;
+  }
+  if (ratio < 1 - tolerance / 100) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void usage(char *s)
+{
+  fprintf(stderr, "Usage: %s [-u|--update] [-n|--no-times] "
+          "[-r|--reps <reps>]\n"
+          "       [-p|--tolerance <percent>] [-t|--turns <turns>]\n"
+          "       [-s|--seed <seed>]... [-k|--keys <script>] <baseline>\n",
+          s);
+
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *verdict[] = { "faster", "ok", "SLOWER" };
+  static regress_seed_t base[REGRESS_MAX_SEEDS], cur[REGRESS_MAX_SEEDS];
+  const char *path;
+  uint32_t reps, turns, seed[REGRESS_MAX_SEEDS];
+  int32_t i, j, n, num_seeds, update, times;
+  double tolerance, gen, play, gen_ratio, play_ratio;
+  int differ;
+
+  path = NULL;
+  update = 0;
+  times = 1;
+  reps = REGRESS_REPS;
+  turns = REGRESS_TURNS;
+  tolerance = REGRESS_TOLERANCE;
+  num_seeds = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      if (path) {
+        usage(argv[0]);
+      }
+      path = argv[i];
+      continue;
+    }
+    if (argv[i][1] == '-') {
+      argv[i]++;
+    }
+    if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "-update")) {
+      update = 1;
+    } else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "-no-times")) {
+      times = 0;
+    } else if (i + 1 == argc) {
+      usage(argv[0]);
+    } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "-reps")) {
+      if (!sscanf(argv[++i], "%u", &reps) || !reps) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "-tolerance")) {
+      if (!sscanf(argv[++i], "%lf", &tolerance)) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "-turns")) {
+      if (!sscanf(argv[++i], "%u", &turns) || !turns) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "-seed")) {
+      if (num_seeds == REGRESS_MAX_SEEDS ||
+          !sscanf(argv[++i], "%u", seed + num_seeds++)) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "-keys")) {
+      regress_script = argv[++i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (!path) {
+    usage(argv[0]);
+  }
+
+  /* Without a baseline, or seeds to make one from, there's nothing to do */
+  if ((n = regress_load(path, base)) < 0 && !(update && num_seeds)) {
+    perror(path);
+    exit(1);
+  }
+
+  /* Seeds given replace the baseline's when updating it */
+  if (update && num_seeds) {
+    for (n = 0; n < num_seeds; n++) {
+      cur[n].seed = seed[n];
+      cur[n].turns = turns;
+    }
+  } else {
+    memcpy(cur, base, n * sizeof (*cur));
+  }
+
+  if (regress_ring()) {
+    printf("FAILED: the message ring lost or mangled messages\n");
+    return 1;
+  }
+
+  printf("%-6s %6s %8s %8s %8s  %-22s  %s\n", "seed", "turns",
+         "terrain", "chars", "dist", "gen ms, now/baseline",
+         "play ms, now/baseline");
+
+  differ = 0;
+  gen_ratio = play_ratio = 1;
+  for (i = 0; i < n; i++) {
+    regress_run(cur + i, reps);
+
+    printf("%-6u %6u", cur[i].seed, cur[i].turns);
+    if (update) {
+      printf(" %8s %8s %8s  %7.1f%15s  %7.1f\n", "new", "new", "new",
+             cur[i].r.gen / 1000000.0, "", cur[i].r.play / 1000000.0);
+      continue;
+    }
+
+    for (j = 0; j < num_regress_hashes; j++) {
+      if (cur[i].r.hash[j] == base[i].r.hash[j]) {
+        printf(" %8s", "same");
+      } else {
+        printf(" %8s", "DIFFERS");
+        differ = 1;
+      }
+    }
+    gen = (double) cur[i].r.gen / base[i].r.gen;
+    play = (double) cur[i].r.play / base[i].r.play;
+    printf("  %7.1f/%-7.1f %-6s  %7.1f/%-7.1f %s\n",
+           cur[i].r.gen / 1000000.0, base[i].r.gen / 1000000.0,
+           verdict[regress_time(gen, tolerance) + 1],
+           cur[i].r.play / 1000000.0, base[i].r.play / 1000000.0,
+           verdict[regress_time(play, tolerance) + 1]);
+    gen_ratio *= gen;
+    play_ratio *= play;
+  }
+
+  if (update) {
+    regress_save(path, cur, n);
+    printf("Wrote %d seeds to %s\n", n, path);
+    return 0;
+  }
+
+  for (i = 0; i < n && differ; i++) {
+    for (j = 0; j < num_regress_hashes; j++) {
+      if (cur[i].r.hash[j] != base[i].r.hash[j]) {
+        fprintf(stderr, "Seed %u: %s hash %016llx, expected %016llx\n",
+                cur[i].seed, regress_hash_name[j],
+                (unsigned long long) cur[i].r.hash[j],
+                (unsigned long long) base[i].r.hash[j]);
+      }
+    }
+  }
+
+  /* Any one seed's time is noisy, so only all of them together count */
+  gen_ratio = n ? pow(gen_ratio, 1.0 / n) : 1;
+  play_ratio = n ? pow(play_ratio, 1.0 / n) : 1;
+  printf("Time taken against the baseline, geometric mean: "
+         "generation %+.1f%%, play %+.1f%%\n",
+         (gen_ratio - 1) * 100, (play_ratio - 1) * 100);
+
+  if (differ) {
+    printf("FAILED: results differ from the baseline\n");
+    return 1;
+  }
+  if (times && (regress_time(gen_ratio, tolerance) > 0 ||
+                regress_time(play_ratio, tolerance) > 0)) {
+    printf("FAILED: slower than the baseline by more than %.0f%%\n",
+           tolerance);
+    return 1;
+  }
+
+  printf("Passed\n");
+
+  return 0;
+}
@@ -0,0 +1,337 @@
+#include <cstring>
+#include <cstdlib>
+
+#include "route.h"
+#include "prof.h"
+
+/* Routes across the world are planned on an abstract graph rather than  *
+ * cell by cell.  A node is a gate of some map, standing just inside it, *
+ * and there are two kinds of edge: walking across a map from one of its *
+ * gates to another, and stepping through a gate into the next map.      *
+ * Walking costs come from a Dijkstra run per gate the first time a      *
+ * route crosses a map, then stay with the map (map::gate_cost).  Maps   *
+ * that haven't been generated yet aren't generated for this; a gate     *
+ * they share with a generated neighbor is where the neighbor says, any  *
+ * other is taken to be midway along its side, and walking between them  *
+ * is guessed at a straight line of path.  A* searches the graph over    *
+ * the box of maps spanning both ends, with ROUTE_MARGIN maps to spare.  */
+#define ROUTE_MARGIN 1
+
+/* Cheapest terrain the PC can walk on */
+#define ROUTE_STEP move_cost[char_pc][ter_path]
+
+static const int16_t side_dir[num_gate_sides][2] = {
+  {  0, -1 },
+  {  1,  0 },
+  {  0,  1 },
+  { -1,  0 },
+};
+
+#define opposite(g) ((gate_side_t) (((g) + 2) % num_gate_sides))
+
+typedef struct route_node {
+  heap_node_t *hn;
+  int32_t cost;
+  /* cost plus a lower bound on the rest of the way */
+  int32_t est;
+  /* Index of the node this one was reached from, or -1 at the start */
+  int32_t from;
+  int done;
+} route_node_t;
+
+static int32_t route_cmp(const void *key, const void *with)
+{
+  return ((route_node_t *) key)->est - ((route_node_t *) with)->est;
+}
+
+/* Where along side g m's gate is; -1 if it has none */
+static int32_t gate_of(const map *m, gate_side_t g)
+{
+  switch (g) {
+  case gate_n:
+    return m->n;
+  case gate_e:
+    return m->e;
+  case gate_s:
+    return m->s;
+  default:
+    return m->w;
+  }
+}
+
+/* Whether map (x, y) has a gate on side g, generated or not; only the *
+ * edge of the world has none.                                         */
+static int has_gate(int32_t x, int32_t y, gate_side_t g)
+{
+  x += side_dir[g][dim_x];
+  y += side_dir[g][dim_y];
+
+  return x >= 0 && x < WORLD_SIZE && y >= 0 && y < WORLD_SIZE;
+}
+
+/* Where along side g map (x, y)'s gate is, or -1 if there's no telling *
+ * without generating it.  A gate is shared with the map beyond, so     *
+ * either one will do.                                                  */
+static int32_t gate_pos(int32_t x, int32_t y, gate_side_t g)
+{
+  if (world.world[y][x]) {
+    return gate_of(world.world[y][x], g);
+  }
+
+  x += side_dir[g][dim_x];
+  y += side_dir[g][dim_y];
+
+  return world.world[y][x] ? gate_of(world.world[y][x], opposite(g)) : -1;
+}
+
+/* The cell just inside the gate at p along side g; midway if p is -1 */
+static void gate_inside(gate_side_t g, int32_t p, pair_t c)
+{
+  switch (g) {
+  case gate_n:
+  case gate_s:
+    c[dim_x] = p < 0 ? MAP_X / 2 : p;
+    c[dim_y] = g == gate_n ? 1 : MAP_Y - 2;
+    break;
+  default:
+    c[dim_x] = g == gate_w ? 1 : MAP_X - 2;
+    c[dim_y] = p < 0 ? MAP_Y / 2 : p;
+    break;
+  }
+}
+
+/* The PC's walking cost from every cell of m to just inside gate g */
+static void gate_dist(const map *m, gate_side_t g, int dist[MAP_Y][MAP_X])
+{
+  row_t target[MAP_Y];
+  pair_t c;
+
+  memset(target, 0, sizeof (target));
+  gate_inside(g, gate_of(m, g), c);
+  target[c[dim_y]] = row_bit(c[dim_x]);
+
+  pc_dist_to_cells(m, target, dist);
+}
+
+static void map_gate_costs(map *m)
+{
+  static int dist[MAP_Y][MAP_X];
+  int32_t g, h;
+  pair_t c;
+
+  for (h = 0; h < num_gate_sides; h++) {
+    if (gate_of(m, (gate_side_t) h) >= 0) {
+      gate_dist(m, (gate_side_t) h, dist);
+    }
+    for (g = 0; g < num_gate_sides; g++) {
+      if (gate_of(m, (gate_side_t) h) < 0 || gate_of(m, (gate_side_t) g) < 0) {
+        m->gate_cost[g][h] = DIJKSTRA_PATH_MAX;
+      } else {
+        gate_inside((gate_side_t) g, gate_of(m, (gate_side_t) g), c);
+        m->gate_cost[g][h] = dist[c[dim_y]][c[dim_x]];
+      }
+    }
+  }
+
+  m->gate_cost_known = 1;
+}
+
+/* Walking across map (x, y) from just inside gate g to just inside h */
+static int32_t cross_map(int32_t x, int32_t y, gate_side_t g, gate_side_t h)
+{
+  map *m;
+  pair_t a, b;
+
+  if ((m = world.world[y][x])) {
+    if (!m->gate_cost_known) {
+      map_gate_costs(m);
+    }
+    return m->gate_cost[g][h];
+  }
+
+  gate_inside(g, gate_pos(x, y, g), a);
+  gate_inside(h, gate_pos(x, y, h), b);
+
+  return ROUTE_STEP * (abs(a[dim_x] - b[dim_x]) > abs(a[dim_y] - b[dim_y]) ?
+                       abs(a[dim_x] - b[dim_x]) : abs(a[dim_y] - b[dim_y]));
+}
+
+/* Stepping through a gate into map (x, y), which it is on side g of, *
+ * costs the terrain just inside.                                      */
+static int32_t enter_map(int32_t x, int32_t y, gate_side_t g)
+{
+  map *m;
+  pair_t c;
+
+  if (!(m = world.world[y][x])) {
+    return ROUTE_STEP;
+  }
+
+  gate_inside(g, gate_of(m, g), c);
+
+  return move_cost[char_pc][ter_at(m, c[dim_x], c[dim_y])];
+}
+
+/* A lower bound on the way from anywhere in map (x, y) to map to: each *
+ * map boundary between is a step, and each map wholly between takes   *
+ * crossing from one side to the other.  Steps can go diagonally, so   *
+ * only the longer of the two ways counts.                             */
+static int32_t route_guess(int32_t x, int32_t y, const pair_t to)
+{
+  int32_t dx, dy;
+
+  dx = abs(to[dim_x] - x);
+  dy = abs(to[dim_y] - y);
+  dx = dx ? dx + (dx - 1) * (MAP_X - 3) : 0;
+  dy = dy ? dy + (dy - 1) * (MAP_Y - 3) : 0;
+
+  return ROUTE_STEP * (dx > dy ? dx : dy);
+}
+
+/* Plans the PC's walk from where it stands to world index to.  Returns *
+ * 0 and fills r, which route_delete() frees, or 1 if there's no way.   */
+int world_route(const pair_t to, route_t *r)
+{
+  static int dist[MAP_Y][MAP_X];
+  int32_t bx, by, bw, bh, n, i, j, x, y, c, found;
+  gate_side_t g, s;
+  route_node_t *node, *v;
+  heap_t h;
+
+  r->len = 0;
+  r->side = NULL;
+  r->cost = 0;
+  r->exact = 1;
+
+  if (to[dim_x] == world.cur_idx[dim_x] && to[dim_y] == world.cur_idx[dim_y]) {
+    return 0;
+  }
+
+  bx = (to[dim_x] < world.cur_idx[dim_x] ? to : world.cur_idx)[dim_x];
+  by = (to[dim_y] < world.cur_idx[dim_y] ? to : world.cur_idx)[dim_y];
+  bw = abs(to[dim_x] - world.cur_idx[dim_x]) + 1 + 2 * ROUTE_MARGIN;
+  bh = abs(to[dim_y] - world.cur_idx[dim_y]) + 1 + 2 * ROUTE_MARGIN;
+  bx = bx < ROUTE_MARGIN ? 0 : bx - ROUTE_MARGIN;
+  by = by < ROUTE_MARGIN ? 0 : by - ROUTE_MARGIN;
+  bw = bx + bw > WORLD_SIZE ? WORLD_SIZE - bx : bw;
+  bh = by + bh > WORLD_SIZE ? WORLD_SIZE - by : bh;
+
+  n = bw * bh * num_gate_sides;
+  node = (route_node_t *) malloc(n * sizeof (*node));
+  for (i = 0; i < n; i++) {
+    node[i].hn = NULL;
+    node[i].cost = DIJKSTRA_PATH_MAX;
+    node[i].done = 0;
+  }
+
+#define node_at(x, y, g) ((((y) - by) * bw + ((x) - bx)) * num_gate_sides + (g))
+#define relax(j, x, y, c, f) {                                   \
+    if ((c) < node[j].cost && !node[j].done) {                    \
+      node[j].cost = (c);                                         \
+      node[j].est = (c) + route_guess(x, y, to);                  \
+      node[j].from = (f);                                         \
+      if (node[j].hn) {                                           \
+        heap_decrease_key_no_replace(&h, node[j].hn);             \
+      } else {                                                    \
+        node[j].hn = heap_insert(&h, node + (j));                 \
+      }                                                           \
+    }                                                             \
+  }
+
+  heap_init(&h, route_cmp, NULL);
+  PROF_HEAP(&h, prof_heap(prof_heap_route));
+
+  /* The way out of the PC's own map starts from where the PC is */
+  x = world.cur_idx[dim_x];
+  y = world.cur_idx[dim_y];
+  for (g = gate_n; g < num_gate_sides; g = (gate_side_t) (g + 1)) {
+    if (gate_of(world.cur_map, g) >= 0) {
+      gate_dist(world.cur_map, g, dist);
+      c = dist[world.pc.pos[dim_y]][world.pc.pos[dim_x]];
+      if (c != DIJKSTRA_PATH_MAX) {
+        j = node_at(x, y, g);
+        relax(j, x, y, c, -1);
+      }
+    }
+  }
+
+  found = -1;
+  while ((v = (route_node_t *) heap_remove_min(&h))) {
+    v->hn = NULL;
+    v->done = 1;
+    i = v - node;
+    g = (gate_side_t) (i % num_gate_sides);
+    x = bx + (i / num_gate_sides) % bw;
+    y = by + (i / num_gate_sides) / bw;
+
+    if (x == to[dim_x] && y == to[dim_y]) {
+      found = i;
+      break;
+    }
+
+    /* Through the gate */
+    if (has_gate(x, y, g)) {
+      x += side_dir[g][dim_x];
+      y += side_dir[g][dim_y];
+      s = opposite(g);
+      if (x >= bx && x < bx + bw && y >= by && y < by + bh) {
+        c = v->cost + enter_map(x, y, s);
+        j = node_at(x, y, s);
+        relax(j, x, y, c, i);
+      }
+      x -= side_dir[g][dim_x];
+      y -= side_dir[g][dim_y];
+    }
+
+    /* Across the map to another gate */
+    for (s = gate_n; s < num_gate_sides; s = (gate_side_t) (s + 1)) {
+      if (s != g && has_gate(x, y, s) &&
+          (c = cross_map(x, y, g, s)) != DIJKSTRA_PATH_MAX) {
+        c += v->cost;
+        j = node_at(x, y, s);
+        relax(j, x, y, c, i);
+      }
+    }
+  }
+
+#undef relax
+#undef node_at
+
+  heap_delete(&h);
+
+  if (found < 0) {
+    free(node);
+    return 1;
+  }
+
+  /* Every change of map along the way is a gate to leave by */
+  r->cost = node[found].cost;
+  for (i = found; node[i].from >= 0; i = node[i].from) {
+    if (i / num_gate_sides != node[i].from / num_gate_sides) {
+      r->len++;
+    }
+  }
+  r->side = (gate_side_t *) malloc(r->len * sizeof (*r->side));
+  for (j = r->len, i = found; i >= 0; i = node[i].from) {
+    x = bx + (i / num_gate_sides) % bw;
+    y = by + (i / num_gate_sides) / bw;
+    if (!world.world[y][x]) {
+      r->exact = 0;
+    }
+    if (node[i].from >= 0 &&
+        i / num_gate_sides != node[i].from / num_gate_sides) {
+      r->side[--j] = (gate_side_t) (node[i].from % num_gate_sides);
+    }
+  }
+
+  free(node);
+
+  return 0;
+}
+
+void route_delete(route_t *r)
+{
+  free(r->side);
+  r->side = NULL;
+  r->len = 0;
+}
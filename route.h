@@ -0,0 +1,22 @@
+#ifndef ROUTE_H
+# define ROUTE_H
+
+# include <cstdint>
+
+# include "poke327.h"
+
+/* A walking route across the world from where the PC stands: leave   *
+ * each map in turn by the gate on side[i], and the last one leads to *
+ * the destination.  cost is in move_cost units, exact if every map   *
+ * along the way has been generated and an estimate otherwise.        */
+typedef struct route {
+  uint32_t len;
+  gate_side_t *side;
+  int32_t cost;
+  int exact;
+} route_t;
+
+int world_route(const pair_t to, route_t *r);
+void route_delete(route_t *r);
+
+#endif